@@ -0,0 +1,321 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+// Benchmark the compression settings on a synthetic header corpus.
+// For each --fast and --level setting, prints the speed (MB/s of input)
+// and the compression ratio, so that a setting can be picked per use case.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h> // memfd_create
+#include <sys/stat.h>
+#include <arpa/inet.h> // htonl
+#include "zpkglist.h"
+#include "xwrite.h"
+#include "header.h"
+
+#define PROG "zpkglist-bench"
+#define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
+#define die(fmt, args...) warn(fmt, ##args), exit(128)
+
+// Parse a numeric option's argument, which must be within [min, max].
+static int parseNum(const char *opt, const char *arg, int min, int max)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || n < min || n > max)
+	die("invalid %s value: %s", opt, arg);
+    return n;
+}
+
+// A fixed-seed PRNG, so that the corpus is the same on every run.
+static uint64_t seed = 0x9E3779B97F4A7C15;
+
+static unsigned rnd(unsigned n)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return (seed >> 32) % n;
+}
+
+static const char *words[] = {
+    "lib", "perl", "python3", "ruby", "gtk", "qt5", "kde", "gnome", "xml",
+    "ssl", "x11", "fonts", "utils", "tools", "common", "devel", "doc",
+    "server", "client", "data", "plugins", "core", "base", "extra", "mod",
+    "sql", "net", "http", "image", "audio", "video", "crypto", "test",
+};
+#define NWORDS (sizeof words / sizeof *words)
+
+static const char *dirs[] = {
+    "/usr/bin/", "/usr/lib64/", "/usr/share/doc/", "/usr/share/man/man1/",
+    "/usr/include/", "/usr/share/locale/ru/LC_MESSAGES/", "/etc/",
+    "/usr/lib64/pkgconfig/", "/usr/share/icons/hicolor/48x48/apps/",
+};
+#define NDIRS (sizeof dirs / sizeof *dirs)
+
+// The header being built, the entries are added in the order of tags.
+struct hdr {
+    unsigned il, dl;
+    unsigned ee[32][4];
+    char *data;
+    size_t dataSize;
+};
+
+static char *hdrReserve(struct hdr *h, size_t size)
+{
+    if (h->dl + size > h->dataSize) {
+	while (h->dl + size > h->dataSize)
+	    h->dataSize = h->dataSize ? 2 * h->dataSize : (64 << 10);
+	h->data = realloc(h->data, h->dataSize);
+	if (!h->data)
+	    die("realloc: %m");
+    }
+    return h->data + h->dl;
+}
+
+static void hdrEntry(struct hdr *h, int tag, unsigned type, unsigned cnt)
+{
+    unsigned *e = h->ee[h->il++];
+    e[0] = htonl(tag), e[1] = htonl(type), e[2] = htonl(h->dl), e[3] = htonl(cnt);
+}
+
+static void addString(struct hdr *h, int tag, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    hdrEntry(h, tag, 6, 1);
+    memcpy(hdrReserve(h, len), s, len);
+    h->dl += len;
+}
+
+// A string array, the strings are generated into the data by the callback.
+static void addStrings(struct hdr *h, int tag, unsigned cnt,
+		       void (*gen)(char *buf, unsigned i))
+{
+    hdrEntry(h, tag, 8, cnt);
+    for (unsigned i = 0; i < cnt; i++) {
+	char buf[256];
+	gen(buf, i);
+	size_t len = strlen(buf) + 1;
+	memcpy(hdrReserve(h, len), buf, len);
+	h->dl += len;
+    }
+}
+
+static void addInt32(struct hdr *h, int tag, unsigned cnt, unsigned (*gen)(unsigned i))
+{
+    while (h->dl & 3)
+	*hdrReserve(h, 1) = '\0', h->dl++;
+    hdrEntry(h, tag, 4, cnt);
+    unsigned *v = (unsigned *) hdrReserve(h, 4 * cnt);
+    for (unsigned i = 0; i < cnt; i++)
+	v[i] = htonl(gen(i));
+    h->dl += 4 * cnt;
+}
+
+// The package being generated.
+static char name[64];
+static unsigned ndirs;
+
+static void genName(void)
+{
+    snprintf(name, sizeof name, "%s%s-%s", words[rnd(NWORDS)],
+	     words[rnd(NWORDS)], words[rnd(NWORDS)]);
+}
+
+static void genDep(char *buf, unsigned i)
+{
+    if (rnd(3) == 0)
+	sprintf(buf, "lib%s.so.%u()(64bit)", words[rnd(NWORDS)], rnd(8));
+    else
+	sprintf(buf, "%s-%s", words[rnd(NWORDS)], words[rnd(NWORDS)]);
+}
+
+static void genProvide(char *buf, unsigned i)
+{
+    if (i == 0)
+	strcpy(buf, name);
+    else
+	sprintf(buf, "%s(%s)", name, words[rnd(NWORDS)]);
+}
+
+static void genBasename(char *buf, unsigned i)
+{
+    sprintf(buf, "%s%s%u.%s", words[rnd(NWORDS)], name, i,
+	    rnd(2) ? "so" : "html");
+}
+
+static void genDirname(char *buf, unsigned i)
+{
+    sprintf(buf, "%s%s/", dirs[i % NDIRS], i < NDIRS ? "" : name);
+}
+
+static unsigned genDirindex(unsigned i) { return rnd(ndirs); }
+static unsigned genFilesize(unsigned i) { return rnd(1 << (4 + rnd(16))); }
+static unsigned genBuildtime(unsigned i) { return 1500000000 + rnd(1 << 26); }
+static unsigned genSize(unsigned i) { return rnd(1 << 24); }
+
+// Generate a header and write it with the magic.  Now and then,
+// a package has a lot of files, which makes a jumbo frame.
+static size_t genHeader(struct hdr *h, int fd)
+{
+    h->il = h->dl = 0;
+    genName();
+    unsigned nfiles = rnd(500) ? 1 + rnd(40) : 4000 + rnd(4000);
+    ndirs = nfiles < NDIRS ? nfiles : NDIRS + rnd(nfiles / 4 + 1);
+    char buf[256];
+    addString(h, 1000, name);
+    sprintf(buf, "%u.%u.%u", rnd(10), rnd(30), rnd(100));
+    addString(h, 1001, buf);
+    sprintf(buf, "alt%u", 1 + rnd(3));
+    addString(h, 1002, buf);
+    sprintf(buf, "%s %s for %s", words[rnd(NWORDS)], words[rnd(NWORDS)], name);
+    addString(h, 1004, buf);
+    addInt32(h, 1006, 1, genBuildtime);
+    addInt32(h, 1009, 1, genSize);
+    addString(h, 1014, rnd(2) ? "GPLv2+" : "MIT");
+    addString(h, 1016, "System/Libraries");
+    addString(h, 1022, rnd(4) ? "x86_64" : "noarch");
+    addInt32(h, 1028, nfiles, genFilesize);
+    addStrings(h, 1047, 1 + rnd(4), genProvide);
+    addStrings(h, 1049, 1 + rnd(12), genDep);
+    addInt32(h, 1116, nfiles, genDirindex);
+    addStrings(h, 1117, nfiles, genBasename);
+    addStrings(h, 1118, ndirs, genDirname);
+
+    unsigned lead[4];
+    memcpy(lead, headerMagic, 8);
+    lead[2] = htonl(h->il), lead[3] = htonl(h->dl);
+    if (!xwrite(fd, lead, 16) ||
+	!xwrite(fd, h->ee, 16 * h->il) ||
+	!xwrite(fd, h->data, h->dl))
+	die("write: %m");
+    return 16 + 16 * h->il + h->dl;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Compress the corpus with the options, print the stats.
+static void bench(int infd, int outfd, size_t insize,
+		  const struct zpkglistCompressOptions *opt, const char *label)
+{
+    if (lseek(infd, 0, SEEK_SET) < 0 || lseek(outfd, 0, SEEK_SET) < 0)
+	die("lseek: %m");
+    if (ftruncate(outfd, 0) < 0)
+	die("ftruncate: %m");
+    const char *err[2];
+    double t = now();
+    ssize_t n = zpkglistCompress2(infd, outfd, NULL, NULL, opt, err);
+    t = now() - t;
+    if (n < 0)
+	die("zpkglistCompress2: %s: %s", err[0], err[1]);
+    struct stat st;
+    if (fstat(outfd, &st) < 0)
+	die("fstat: %m");
+    printf("%-16s %8.1f MB/s %7.2f\n", label, insize / t / 1e6,
+	   (double) insize / st.st_size);
+    fflush(stdout);
+}
+
+enum {
+    OPT_HELP = 256,
+    OPT_ZSTD,
+};
+
+static const struct option longopts[] = {
+    { "headers", required_argument, NULL, 'n' },
+    { "threads", required_argument, NULL, 'T' },
+    { "zstd", no_argument, NULL, OPT_ZSTD },
+    { "help", no_argument, NULL, OPT_HELP },
+    { NULL },
+};
+
+int main(int argc, char **argv)
+{
+    int c;
+    bool usage = false;
+    int nhdr = 20000;
+    int nthreads = 1;
+    bool zstd = false;
+    while ((c = getopt_long(argc, argv, "n:T:", longopts, NULL)) != -1) {
+	switch (c) {
+	case 'n':
+	    nhdr = parseNum("-n", optarg, 1, INT_MAX);
+	    break;
+	case 'T':
+	    nthreads = parseNum("-T", optarg, 0, 1024);
+	    break;
+	case OPT_ZSTD:
+	    zstd = true;
+	    break;
+	default:
+	    usage = true;
+	}
+    }
+    if (usage || argc > optind) {
+	fprintf(stderr, "Usage: " PROG " [-n HEADERS] [-T NUM] [--zstd]\n");
+	return 1;
+    }
+
+    // The corpus and the output are kept in memory.
+    int infd = memfd_create("corpus", 0);
+    int outfd = memfd_create("output", 0);
+    if (infd < 0 || outfd < 0)
+	die("memfd_create: %m");
+    struct hdr h = { 0 };
+    size_t insize = 0;
+    for (int i = 0; i < nhdr; i++)
+	insize += genHeader(&h, infd);
+    free(h.data);
+    printf("%d headers, %.1f MB\n", nhdr, insize / 1e6);
+
+    struct zpkglistCompressOptions opt = { .nthreads = nthreads, .zstd = zstd };
+    char label[32];
+    if (!zstd) {
+	for (int accel = 64; accel >= 1; accel /= 2) {
+	    opt.accel = accel;
+	    snprintf(label, sizeof label, "--fast=%d", accel);
+	    bench(infd, outfd, insize, &opt, label);
+	}
+	opt.accel = 0;
+    }
+    int maxLevel = zstd ? 19 : 12;
+    for (int level = 1; level <= maxLevel; level++) {
+	opt.level = level;
+	snprintf(label, sizeof label, "--level=%d", level);
+	bench(infd, outfd, insize, &opt, label);
+    }
+    return 0;
+}
@@ -0,0 +1,144 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "zpkglist.h"
+
+// Type numbers, as defined in rpm/header.h.
+enum {
+    T_CHAR = 1, T_INT8, T_INT16, T_INT32, T_INT64,
+    T_STRING, T_BIN, T_STRING_ARRAY, T_I18NSTRING,
+};
+
+// The blob returned by NextView is not necessarily aligned.
+static inline unsigned load32(const void *p)
+{
+    unsigned x;
+    memcpy(&x, p, 4);
+    return ntohl(x);
+}
+
+bool zpkglistBlobGet(const struct HeaderBlob *blob, size_t blobSize, int tag,
+		     int *typep, const void **datap, unsigned *countp)
+{
+    if (blobSize < 8)
+	return false;
+    const char *ei = (const char *) blob;
+    unsigned il = load32(ei + 0);
+    unsigned dl = load32(ei + 4);
+    if (il > (blobSize - 8) / 16 || dl > blobSize - 8 - 16 * il)
+	return false;
+    const char *ee = ei + 8;
+    const char *data = ee + 16 * il;
+    for (; ee < data; ee += 16) {
+	if ((int) load32(ee + 0) != tag)
+	    continue;
+	int type = load32(ee + 4);
+	unsigned off = load32(ee + 8);
+	unsigned cnt = load32(ee + 12);
+	if (off >= dl || cnt == 0)
+	    return false;
+	const char *p = data + off;
+	size_t left = dl - off;
+	size_t size;
+	switch (type) {
+	case T_CHAR:
+	case T_INT8:
+	case T_BIN:
+	    size = 1;
+	    break;
+	case T_INT16:
+	    size = 2;
+	    break;
+	case T_INT32:
+	    size = 4;
+	    break;
+	case T_INT64:
+	    size = 8;
+	    break;
+	case T_STRING:
+	    if (cnt != 1)
+		return false;
+	    // fall through
+	case T_STRING_ARRAY:
+	case T_I18NSTRING:
+	    // Each string must be terminated within the data segment.
+	    for (unsigned j = 0; j < cnt; j++) {
+		const char *z = memchr(p, '\0', left);
+		if (!z)
+		    return false;
+		left -= z + 1 - p, p = z + 1;
+	    }
+	    size = 0;
+	    break;
+	default:
+	    return false;
+	}
+	if (size && cnt > left / size)
+	    return false;
+	*typep = type;
+	*datap = data + off;
+	*countp = cnt;
+	return true;
+    }
+    return false;
+}
+
+const char *zpkglistBlobGetString(const struct HeaderBlob *blob, size_t blobSize,
+				  int tag)
+{
+    int type;
+    const void *data;
+    unsigned cnt;
+    if (!zpkglistBlobGet(blob, blobSize, tag, &type, &data, &cnt))
+	return NULL;
+    if (type != T_STRING && type != T_I18NSTRING)
+	return NULL;
+    return data;
+}
+
+const char *zpkglistBlobGetStringArray(const struct HeaderBlob *blob, size_t blobSize,
+				       int tag, unsigned *countp)
+{
+    int type;
+    const void *data;
+    unsigned cnt;
+    if (!zpkglistBlobGet(blob, blobSize, tag, &type, &data, &cnt))
+	return NULL;
+    if (type != T_STRING && type != T_STRING_ARRAY)
+	return NULL;
+    *countp = cnt;
+    return data;
+}
+
+const uint32_t *zpkglistBlobGetInt32Array(const struct HeaderBlob *blob, size_t blobSize,
+					  int tag, unsigned *countp)
+{
+    int type;
+    const void *data;
+    unsigned cnt;
+    if (!zpkglistBlobGet(blob, blobSize, tag, &type, &data, &cnt))
+	return NULL;
+    if (type != T_INT32)
+	return NULL;
+    *countp = cnt;
+    return data;
+}
@@ -0,0 +1,92 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+#include <endian.h>
+#include "bswap.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#endif
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+static void bswapScalar(char *dst, const char *src, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+	unsigned x;
+	memcpy(&x, src + 4 * i, 4);
+	x = __builtin_bswap32(x);
+	memcpy(dst + 4 * i, &x, 4);
+    }
+}
+
+#ifdef X86
+__attribute__((target("ssse3")))
+static void bswapSSSE3(char *dst, const char *src, size_t n)
+{
+    const __m128i shuf = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+				       11, 10, 9, 8, 15, 14, 13, 12);
+    for (; n >= 4; n -= 4, src += 16, dst += 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) src);
+	_mm_storeu_si128((__m128i *) dst, _mm_shuffle_epi8(x, shuf));
+    }
+    bswapScalar(dst, src, n);
+}
+
+__attribute__((target("avx2")))
+static void bswapAVX2(char *dst, const char *src, size_t n)
+{
+    const __m256i shuf = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12,
+					  3, 2, 1, 0, 7, 6, 5, 4,
+					  11, 10, 9, 8, 15, 14, 13, 12);
+    // Two vectors per iteration, the typical index being a few hundred bytes.
+    for (; n >= 16; n -= 16, src += 64, dst += 64) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) src);
+	__m256i y = _mm256_loadu_si256((const __m256i *) src + 1);
+	_mm256_storeu_si256((__m256i *) dst, _mm256_shuffle_epi8(x, shuf));
+	_mm256_storeu_si256((__m256i *) dst + 1, _mm256_shuffle_epi8(y, shuf));
+    }
+    if (n >= 8) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) src);
+	_mm256_storeu_si256((__m256i *) dst, _mm256_shuffle_epi8(x, shuf));
+	n -= 8, src += 32, dst += 32;
+    }
+    bswapScalar(dst, src, n);
+}
+#endif
+#endif
+
+void ntohlcopy(void *dst, const void *src, size_t n)
+{
+#if __BYTE_ORDER != __LITTLE_ENDIAN
+    memcpy(dst, src, 4 * n);
+#elif defined(X86)
+    if (__builtin_cpu_supports("avx2"))
+	bswapAVX2(dst, src, n);
+    else if (__builtin_cpu_supports("ssse3"))
+	bswapSSSE3(dst, src, n);
+    else
+	bswapScalar(dst, src, n);
+#else
+    bswapScalar(dst, src, n);
+#endif
+}
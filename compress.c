@@ -26,12 +26,16 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <pthread.h>
 #include <endian.h>
 #include <lz4.h>
+#include <lz4hc.h>
+#include <zstd.h>
 #include "zpkglist.h"
 #include "error.h"
 #include "xwrite.h"
 #include "header.h"
+#include "reada.h"
 #include "train/rpmhdrzdict.h"
 
 struct Z {
@@ -43,6 +47,32 @@ struct Z {
     // the LZ4 library makes some provision to ensure that the size won't
     // change, namely it uses "union LZ4_stream_u" to reserve some space).
     LZ4_stream_t stream0, stream;
+    // With LZ4HC, the clean state and the working state are allocated
+    // separately, they are much bigger.  The same dictionary is loaded.
+    LZ4_streamHC_t *hc;
+    int level;
+    // The acceleration factor for the fast LZ4 compression.
+    int accel;
+    // With zstd, the dictionary is shared by the threads as ZSTD_CDict
+    // (the level is baked into it), each Z has its own context.
+    const ZSTD_CDict *cdict;
+    ZSTD_CCtx *cctx;
+    // The frame being processed: the uncompressed data (either z->buf,
+    // or a malloc'd chunk for a big jumbo frame), and the compressed data,
+    // preceded by 12 bytes of the frame header.
+    char *in, *out;
+    size_t fill;
+    int zsize;
+    bool jumbo;
+    // The number of headers in the frame, and the hashes of their names.
+    int nhdr, nnames;
+    struct name {
+	unsigned hash;
+	unsigned hdr;
+    } names[4];
+    // Multithreaded mode: the frame has been compressed (or failed to).
+    bool done, ok;
+    const char *err[2];
     // The dictionary, must be adjacent to the input data.
     char dict[64<<10];
     // The input buffer (which contains a few rpm header blobs) and the output
@@ -50,211 +80,196 @@ struct Z {
     char buf[(128<<10)+LZ4_COMPRESSBOUND(128<<10)];
 };
 
-ssize_t zpkglistCompress(int infd, int outfd,
-			 void (*hash)(const void *buf, size_t size, void *arg),
-			 void *arg, const char *err[2])
+// Allocate and initialize the compressor state.  Level 0 stands for
+// the fast LZ4 compression (with the acceleration factor), other levels
+// select LZ4HC.  With cdict, the frames are compressed with zstd instead.
+static struct Z *newZ(int level, int accel, const ZSTD_CDict *cdict)
 {
-    // Get the initial file position, will seek back.
-    off_t pos0 = lseek(outfd, 0, SEEK_CUR);
-    if (pos0 < 0)
-	return ERRNO("lseek"), -1;
-
-    // Prepare the leading frame.
-    struct {
-	unsigned magic;
-	unsigned size16;
-	uint64_t total;
-	unsigned buf1size;
-	unsigned jbufsize;
-    } frame0 = { htole32(0x184D2A55), htole32(16), 0, 0, 0 };
-
-    // Write the leading frame, to be rewritten later.
-    if (!xwrite(outfd, &frame0, sizeof frame0))
-	return ERRNO("write"), -1;
-
-    // Open the input.
-    struct zpkglistReader *zin;
-    int rc = zpkglistFdopen(&zin, infd, err);
-    if (rc <= 0)
-	return rc;
-
-    // The input has been opened, and must be closed upon return.  I understand
-    // C++ can overload operators, but can it overload operator return?
-#define freez (void)0
-#define freebuf (void)0
-#define freezbuf (void)0
-#define return return zpkglistFree(zin), freez, freebuf, freezbuf,
-
-    // Load the leading bytes of the first header: 8 magic + 8 (il,dl).
-    unsigned lead[4];
-    ssize_t ret = zpkglistRead(zin, lead, 16, err);
-    // If it's EOF or an error, do nothing.
-    if (ret <= 0)
-	return ret;
-    if (ret < 16)
-	return ERRSTR("unexpected EOF"), -1;
-    if (!headerCheckMagic(lead))
-	return ERRSTR("bad header magic"), -1;
-
-    // The size of the header's data after (il,dl).
-    ssize_t dataSize = headerDataSize(lead);
-    if (dataSize < 0)
-	return ERRSTR("bad header size"), -1;
-
-    // Write the dictionary frame.
-    if (!xwrite(outfd, rpmhdrzdict, sizeof rpmhdrzdict))
-	return ERRNO("write"), -1;
-
-    // Set buf1size to zdict size (not including the frame header).
-    frame0.buf1size = sizeof rpmhdrzdict - 8;
-
-    // Allocate and initialize the compressor state.
     struct Z *z = malloc(sizeof *z);
     if (!z)
-	return ERRNO("malloc"), -1;
+	return NULL;
+    z->hc = NULL;
+    z->level = level;
+    z->accel = accel > 1 ? accel : 1;
+    z->cdict = cdict;
+    z->cctx = NULL;
+    if (cdict) {
+	z->cctx = ZSTD_createCCtx();
+	if (!z->cctx)
+	    return free(z), NULL;
+    }
+    else if (level > 0) {
+	z->hc = malloc(2 * sizeof *z->hc);
+	if (!z->hc)
+	    return free(z), NULL;
+    }
     // Uncompress the dictionary into z->dict.
     int zret = LZ4_decompress_fast(rpmhdrzdict + 8, z->dict, sizeof z->dict);
     assert(zret == sizeof rpmhdrzdict - 8);
-    // Initialize the clean state.
+    // Initialize the clean state.  The state refers to the dictionary
+    // by its address, and so each Z has to load its own copy.
     memset(&z->stream0, 0, sizeof z->stream0);
     // Load the dictionary into the clean state.
     zret = LZ4_loadDict(&z->stream0, z->dict, sizeof z->dict);
     assert(zret == sizeof z->dict);
+    if (z->hc) {
+	LZ4_initStreamHC(&z->hc[0], sizeof z->hc[0]);
+	LZ4_resetStreamHC_fast(&z->hc[0], level);
+	zret = LZ4_loadDictHC(&z->hc[0], z->dict, sizeof z->dict);
+	assert(zret == sizeof z->dict);
+    }
+    z->in = z->out = NULL;
+    return z;
+}
 
-    // Or can C++ overload operators twice in the same scope?
-    // Or can it draw out Leviathan with an hook?
-#undef freez
-#define freez free(z)
+// Free the input chunk of a big jumbo frame.
+static void freeIn(struct Z *z)
+{
+    if (z->in && z->in != z->buf)
+	free(z->in - 8);
+    z->in = NULL;
+}
 
-    // The number of headers processed (the return value).
-    size_t nhdr = 0;
+// Free the output chunk of a jumbo frame.
+static void freeOut(struct Z *z)
+{
+    if (z->out && z->jumbo)
+	free(z->out - 12);
+    z->out = NULL;
+}
 
-    while (1) {
-	// Jumbo frame?
-	if (8 + dataSize > (128<<10)) {
-	    // Input+output won't fit into z->buf.  Try to reuse
-	    // z->buf just for the input.  Need 16 more bytes to peek
-	    // at the next header.  The leading magic won't be written,
-	    // but may need to restore it for hashing the original data.
-	    char *buf = z->buf;
-	    if (8 + dataSize + 16 > sizeof z->buf) {
-		buf = malloc(16 + dataSize + 16);
-		if (!buf)
-		    return ERRNO("malloc"), -1;
-		memset(buf, 0, 8);
-		buf += 8;
-	    }
-#undef freebuf
-#define freebuf (buf == z->buf ? (void)0 : free(buf - 8))
+static void freeZ(struct Z *z)
+{
+    if (!z)
+	return;
+    freeIn(z);
+    freeOut(z);
+    free(z->hc);
+    ZSTD_freeCCtx(z->cctx);
+    free(z);
+}
 
-	    // Fill the input buffer.
-	    memcpy(buf, lead + 2, 8);
-	    ret = zpkglistRead(zin, buf + 8, dataSize + 16, err);
-	    if (ret < 0)
-		return -1;
+// Load the dictionary for zstd compression.
+static ZSTD_CDict *newCDict(int level)
+{
+    char *dict = malloc(64 << 10);
+    if (!dict)
+	return NULL;
+    int zret = LZ4_decompress_fast(rpmhdrzdict + 8, dict, 64 << 10);
+    assert(zret == sizeof rpmhdrzdict - 8);
+    ZSTD_CDict *cdict = ZSTD_createCDict(dict, 64 << 10, level);
+    free(dict);
+    return cdict;
+}
 
-	    bool eof = false;
-	    if (ret == dataSize)
-		eof = true;
-	    else if (ret != dataSize + 16)
-		return ERRSTR("unexpected EOF"), -1;
-	    else {
-		// Save the next header's leading bytes for the next iteration.
-		memcpy(lead, buf + 8 + dataSize, 16);
-		// Verify the next header's magic - otherwise, we aren't even sure
-		// we got the right size.
-		if (!headerCheckMagic(lead))
-		    return ERRSTR("bad header magic"), -1;
-	    }
+// Register the header's name with the name index.
+static void addName(struct Z *z, const void *blob, int ix)
+{
+    const char *name = headerGetString(blob, 1000); // RPMTAG_NAME
+    if (name)
+	z->names[z->nnames++] = (struct name) { headerNameHash(name), ix };
+}
 
-	    // Hash the data.  The leading magic is restored by clobbering
-	    // to and fro the last eight bytes of the dictionary.
-	    if (hash) {
-		char save[8];
-		char *pre = buf - 8;
-		memcpy(save, pre, 8);
-		memcpy(pre, headerMagic, 8);
-		hash(pre, 16 + dataSize, arg);
-		memcpy(pre, save, 8);
-	    }
+// Reading the input, shared by the frames.
+struct In {
+    struct zpkglistReader *z;
+    void (*hash)(const void *buf, size_t size, void *arg);
+    void *arg;
+    // The leading bytes of the next header: 8 magic + 8 (il,dl),
+    // and the size of the header's data after (il,dl).
+    unsigned lead[4];
+    ssize_t dataSize;
+    bool eof;
+    // Collect the names, only if the name index is to be written.
+    bool names;
+};
 
-	    // Allocate the output buffer.  Need 12 extra bytes for the frame header.
-	    size_t zbufSize = LZ4_COMPRESSBOUND(8 + dataSize);
-	    char *zbuf = malloc(12 + zbufSize);
-	    if (!zbuf)
-		return ERRNO("malloc"), -1;
-	    zbuf += 12;
-#undef freezbuf
-#define freezbuf free(zbuf - 12)
+// Read the next frame into z, either a normal frame with up to 4 headers,
+// or a jumbo frame.  The frame is hashed right away, which keeps hashing
+// in order.  Returns the number of headers, 0 on EOF, -1 on error.
+static int readFrame(struct In *in, struct Z *z, const char *err[2])
+{
+    if (in->eof)
+	return 0;
 
-	    // Compress, without dictionary.
-	    int zsize = LZ4_compress_fast(buf, zbuf, 8 + dataSize, zbufSize, 1);
+    ssize_t ret;
+    ssize_t dataSize = in->dataSize;
+    unsigned *lead = in->lead;
 
-	    // Input buffer no longer needed.
-	    freebuf;
-#undef freebuf
-#define freebuf (void)0
+    // Jumbo frame?
+    if (8 + dataSize > (128<<10)) {
+	// Input+output won't fit into z->buf.  Try to reuse
+	// z->buf just for the input.  Need 16 more bytes to peek
+	// at the next header.  The leading magic won't be written,
+	// but may need to restore it for hashing the original data.
+	char *buf = z->buf;
+	if (8 + dataSize + 16 > sizeof z->buf) {
+	    buf = malloc(16 + dataSize + 16);
+	    if (!buf)
+		return ERRNO("malloc"), -1;
+	    memset(buf, 0, 8);
+	    buf += 8;
+	}
+	z->in = buf;
+	z->fill = 8 + dataSize;
+	z->jumbo = true;
+	z->nnames = 0;
 
-	    if (zsize < 1)
-		return ERROR("LZ4_compress_fast", "compression failed"), -1;
-
-	    // Prepend the frame header.
-	    unsigned frameHeader[] = {
-		htole32(0x184D2A57),
-		htole32(zsize + 4), // compressed size + 4, as per the spec
-		htole32(8 + dataSize),
-	    };
-	    memcpy(zbuf - 12, frameHeader, 12);
-
-	    // Write the output.
-	    bool written = xwrite(outfd, zbuf - 12, 12 + zsize);
-
-	    // Free the output buffer.
-	    freezbuf;
-#undef freezbuf
-#define freezbuf (void)0
-
-	    if (!written)
-		return ERRNO("write"), -1;
-
-	    // Update the stats.
-	    frame0.total += 16 + dataSize; // including the magic
-	    if (frame0.buf1size < zsize)
-		frame0.buf1size = zsize;
-	    if (frame0.jbufsize < 8 + dataSize)
-		frame0.jbufsize = 8 + dataSize;
-	    nhdr++;
+	// Fill the input buffer.
+	memcpy(buf, lead + 2, 8);
+	ret = zpkglistRead(in->z, buf + 8, dataSize + 16, err);
+	if (ret < 0)
+	    return -1;
 
-	    // Concatenate the next frame?
-	    if (eof) {
-		ret = zpkglistRead(zin, lead, 16, err);
-		if (ret < 0)
-		    return -1;
-		if (ret == 0)
-		    break; // true EOF
-		if (ret < 16)
-		    return ERRSTR("unexpected EOF"), -1;
-		if (!headerCheckMagic(lead))
-		    return ERRSTR("bad header magic"), -1;
-	    }
+	bool eof = false;
+	if (ret == dataSize)
+	    eof = true;
+	else if (ret != dataSize + 16)
+	    return ERRSTR("unexpected EOF"), -1;
+	if (in->names)
+	    addName(z, buf, 0);
+	if (!eof) {
+	    // Save the next header's leading bytes for the next iteration.
+	    memcpy(lead, buf + 8 + dataSize, 16);
+	    // Verify the next header's magic - otherwise, we aren't even sure
+	    // we got the right size.
+	    if (!headerCheckMagic(lead))
+		return ERRSTR("bad header magic"), -1;
+	}
 
-	    // The next header is for the next iteration.
-	    dataSize = headerDataSize(lead);
-	    if (dataSize < 0)
-		return ERRSTR("bad header size"), -1;
+	// Concatenate the next frame?
+	if (eof) {
+	    ret = zpkglistRead(in->z, lead, 16, err);
+	    if (ret < 0)
+		return -1;
+	    if (ret == 0)
+		in->eof = true; // true EOF
+	    else if (ret < 16)
+		return ERRSTR("unexpected EOF"), -1;
+	    else if (!headerCheckMagic(lead))
+		return ERRSTR("bad header magic"), -1;
+	}
 
-	    // Kind of a separate loop, hard to factor common code.
-	    continue;
+	// The next header is for the next iteration.
+	if (!in->eof) {
+	    in->dataSize = headerDataSize(lead);
+	    if (in->dataSize < 0)
+		return ERRSTR("bad header size"), -1;
 	}
 
+	ret = 1;
+    }
+    else {
 	// Gonna try to fit four headers into 128K.
 	char *cur = z->buf;
-	bool eof = false;
+	z->in = z->buf;
+	z->jumbo = false;
+	z->nnames = 0;
 
 	// Iterate input headers, append to cur.
 	// On each iteration, we know that the header fits in.
-	for (int i = 0; i < 4; i++) {
-	    nhdr++;
+	int i;
+	for (i = 0; i < 4; i++) {
 	    // Put this header's leading bytes.
 	    // The very first magic won't be written.
 	    if (i == 0) {
@@ -268,18 +283,23 @@ ssize_t zpkglistCompress(int infd, int outfd,
 	    }
 
 	    // Read this header's data + the next header's leading bytes.
-	    ret = zpkglistRead(zin, cur, dataSize + 16, err);
+	    ret = zpkglistRead(in->z, cur, dataSize + 16, err);
 	    if (ret < 0)
 		return -1;
+	    if (ret < dataSize)
+		return ERRSTR("unexpected EOF"), -1;
+	    if (in->names)
+		addName(z, cur - 8, i);
 	    cur += dataSize;
 	    // Concatenate the next frame?
 	    if (ret == dataSize) {
 		// No need to append, read directly into lead[].
-		ret = zpkglistRead(zin, lead, 16, err);
+		ret = zpkglistRead(in->z, lead, 16, err);
 		if (ret < 0)
 		    return -1;
 		if (ret == 0) {
-		    eof = true; // true EOF
+		    in->eof = true; // true EOF
+		    i++;
 		    break;
 		}
 		if (ret < 16)
@@ -299,8 +319,8 @@ ssize_t zpkglistCompress(int infd, int outfd,
 		return ERRSTR("bad header magic"), -1;
 
 	    // The next header is for the next iteration - either in this
-	    // "for i" loop, or in the outer "while 1" loop.
-	    dataSize = headerDataSize(lead);
+	    // "for i" loop, or in the next frame.
+	    dataSize = in->dataSize = headerDataSize(lead);
 	    if (dataSize < 0)
 		return ERRSTR("bad header size"), -1;
 
@@ -308,64 +328,1228 @@ ssize_t zpkglistCompress(int infd, int outfd,
 	    // end of the buffer, and the only question remains, does the next
 	    // header still fit in?  If it doesn't, break out early.
 	    // Otherwise, rely on the loop control.
-	    if ((cur - z->buf) + (16 + dataSize) > (128 << 10))
+	    if ((cur - z->buf) + (16 + dataSize) > (128 << 10)) {
+		i++;
 		break;
+	    }
 	}
+	z->fill = cur - z->buf;
+	ret = i;
+    }
+    z->nhdr = ret;
+
+    // Hash the data.  The leading magic is restored by clobbering
+    // to and fro the last eight bytes of the dictionary.
+    if (in->hash) {
+	char save[8];
+	char *pre = z->in - 8;
+	memcpy(save, pre, 8);
+	memcpy(pre, headerMagic, 8);
+	in->hash(pre, 8 + z->fill, in->arg);
+	memcpy(pre, save, 8);
+    }
+
+    return ret;
+}
+
+// Compress the frame that has been read into z.
+static bool compressFrame(struct Z *z, const char *err[2])
+{
+    int zsize;
+    if (z->jumbo) {
+	// Allocate the output buffer.  Need 12 extra bytes for the frame header.
+	size_t zbufSize = z->cctx ? ZSTD_compressBound(z->fill) : LZ4_COMPRESSBOUND(z->fill);
+	char *zbuf = malloc(12 + zbufSize);
+	if (!zbuf)
+	    return ERRNO("malloc"), false;
+	z->out = zbuf + 12;
 
-	// Hash the data.
-	size_t fill = cur - z->buf;
-	if (hash) {
-	    char save[8];
-	    char *pre = z->buf - 8;
-	    memcpy(save, pre, 8);
-	    memcpy(pre, headerMagic, 8);
-	    hash(pre, fill + 8, arg);
-	    memcpy(pre, save, 8);
+	// Compress, without dictionary.
+	if (z->cctx) {
+	    size_t zret = ZSTD_compressCCtx(z->cctx, z->out, zbufSize, z->in, z->fill, z->level);
+	    zsize = ZSTD_isError(zret) ? 0 : zret;
 	}
+	else if (z->hc)
+	    zsize = LZ4_compress_HC(z->in, z->out, z->fill, zbufSize,
+				    z->level);
+	else
+	    zsize = LZ4_compress_fast(z->in, z->out, z->fill, zbufSize, z->accel);
 
-	// Copy the clean state (struct assignment).
-	z->stream = z->stream0;
+	// Input buffer no longer needed.
+	freeIn(z);
 
+	if (zsize < 1)
+	    return ERROR(z->cctx ? "ZSTD_compressCCtx" :
+			 z->hc ? "LZ4_compress_HC" : "LZ4_compress_fast",
+			 "compression failed"), false;
+    }
+    else {
 	// Set up the output buffer right after the input buffer.
-	char *zbuf = z->buf + fill;
-	size_t zbufSize = sizeof z->buf - fill;
-	assert(zbufSize >= LZ4_COMPRESSBOUND(fill));
+	z->out = z->buf + z->fill;
+	size_t zbufSize = sizeof z->buf - z->fill;
+	assert(zbufSize >= LZ4_COMPRESSBOUND(z->fill));
 
-	// Compress the frame.
-	int zsize = LZ4_compress_fast_continue(&z->stream, z->buf, zbuf, fill, zbufSize, 1);
-	if (zsize < 1)
-	    return ERROR("LZ4_compress_fast_continue", "compression failed"), -1;
+	// Copy the clean state (struct assignment) and compress the frame.
+	if (z->cctx) {
+	    size_t zret = ZSTD_compress_usingCDict(z->cctx, z->out, zbufSize,
+						   z->buf, z->fill, z->cdict);
+	    if (ZSTD_isError(zret))
+		return ERROR("ZSTD_compress_usingCDict", ZSTD_getErrorName(zret)), false;
+	    zsize = zret;
+	}
+	else if (z->hc) {
+	    z->hc[1] = z->hc[0];
+	    zsize = LZ4_compress_HC_continue(&z->hc[1], z->buf, z->out, z->fill, zbufSize);
+	    if (zsize < 1)
+		return ERROR("LZ4_compress_HC_continue", "compression failed"), false;
+	}
+	else {
+	    z->stream = z->stream0;
+	    zsize = LZ4_compress_fast_continue(&z->stream, z->buf, z->out, z->fill,
+					       zbufSize, z->accel);
+	    if (zsize < 1)
+		return ERROR("LZ4_compress_fast_continue", "compression failed"), false;
+	}
+    }
+
+    // Prepend the frame header.
+    unsigned frameHeader[] = {
+	htole32(z->cctx ? 0x184D2A5B : 0x184D2A57),
+	htole32(zsize + 4), // compressed size + 4, as per the spec
+	htole32(z->fill),
+    };
+    // With normal frames, clobbers uncompressed input.
+    memcpy(z->out - 12, frameHeader, 12);
+    z->zsize = zsize;
+    return true;
+}
+
+// The leading frame, rewritten at the end.
+struct frame0 {
+    unsigned magic;
+    unsigned size16;
+    uint64_t total;
+    unsigned buf1size;
+    unsigned jbufsize;
+};
+
+// An entry of the index frame.
+struct indexEntry {
+    uint64_t off;
+    unsigned size;
+    unsigned nhdr;
+};
+
+// Writing the output.
+struct Out {
+    int fd;
+    // No index frames: not requested, or appending to a file without
+    // the index, or merging lists without it.
+    bool noIndex;
+    struct frame0 frame0;
+    // The offset of the next frame, relative to the leading frame.
+    uint64_t off;
+    // The index of data frames, written at the end.
+    struct indexEntry *index;
+    size_t nindex, maxindex;
+    // The name index, also written at the end.
+    struct name *names;
+    size_t nnames, maxnames;
+    // The frames are compressed with zstd.
+    bool zstd;
+};
+
+// The magic of the data frames.
+static inline unsigned dataMagic(bool zstd)
+{
+    return htole32(zstd ? 0x184D2A5B : 0x184D2A57);
+}
+
+// Write the dictionary frame.  The zstd variant has the same
+// LZ4-compressed dictionary, only the magic is different.
+static bool writeDict(struct Out *out, const char *err[2])
+{
+    unsigned magic = htole32(out->zstd ? 0x184D2A5A : 0x184D2A56);
+    if (!xwrite(out->fd, &magic, 4))
+	return ERRNO("write"), false;
+    if (!xwrite(out->fd, rpmhdrzdict + 4, sizeof rpmhdrzdict - 4))
+	return ERRNO("write"), false;
+    out->off += sizeof rpmhdrzdict;
+    return true;
+}
+
+// Check the dictionary frame, and find out the codec.
+static bool checkDict(const char dict[sizeof rpmhdrzdict], bool *zstd)
+{
+    unsigned magic;
+    memcpy(&magic, dict, 4);
+    if (magic == htole32(0x184D2A56))
+	*zstd = false;
+    else if (magic == htole32(0x184D2A5A))
+	*zstd = true;
+    else
+	return false;
+    return memcmp(dict + 4, rpmhdrzdict + 4, sizeof rpmhdrzdict - 4) == 0;
+}
+
+// Account for a data frame in the leading frame.
+static void updateStats(struct frame0 *frame0, size_t fill, size_t zsize, bool jumbo)
+{
+    frame0->total += 8 + fill; // including the magic
+    if (jumbo) {
+	if (frame0->buf1size < zsize)
+	    frame0->buf1size = zsize;
+	if (frame0->jbufsize < fill)
+	    frame0->jbufsize = fill;
+    }
+    else {
+	if (frame0->buf1size < fill + zsize)
+	    frame0->buf1size = fill + zsize;
+    }
+}
+
+// Write the compressed frame and update the stats.
+static bool writeFrame(struct Out *out, struct Z *z, const char *err[2])
+{
+    // Register the frame with the index.
+    if (out->nindex == out->maxindex) {
+	size_t maxindex = out->maxindex ? 2 * out->maxindex : 1024;
+	struct indexEntry *index = realloc(out->index, maxindex * sizeof *index);
+	if (!index)
+	    return ERRNO("realloc"), false;
+	out->index = index, out->maxindex = maxindex;
+    }
+    out->index[out->nindex++] = (struct indexEntry) {
+	htole64(out->off), htole32(z->fill), htole32(z->nhdr),
+    };
+    out->off += 12 + z->zsize;
 
-	// Write the frame, along with the frame header.
-	unsigned frameHeader[] = {
-	    htole32(0x184D2A57),
-	    htole32(zsize + 4),
-	    htole32(fill),
+    // Register the names, the header number is the frame number + ix.
+    if (out->nnames + 4 > out->maxnames) {
+	size_t maxnames = out->maxnames ? 2 * out->maxnames : 4096;
+	struct name *names = realloc(out->names, maxnames * sizeof *names);
+	if (!names)
+	    return ERRNO("realloc"), false;
+	out->names = names, out->maxnames = maxnames;
+    }
+    for (int i = 0; i < z->nnames; i++)
+	out->names[out->nnames++] = (struct name) {
+	    z->names[i].hash, (out->nindex - 1) << 2 | z->names[i].hdr,
 	};
-	// Clobbers uncompressed input.
-	memcpy(zbuf - 12, frameHeader, 12);
-	if (!xwrite(outfd, zbuf - 12, 12 + zsize))
-	    return ERRNO("write"), -1;
 
-	// Update the stats.
-	frame0.total += 8 + fill; // including the magic
-	if (frame0.buf1size < fill + zsize)
-	    frame0.buf1size = fill + zsize;
+    // Write the frame, along with the frame header.
+    bool written = xwrite(out->fd, z->out - 12, 12 + z->zsize);
 
-	if (eof)
-	    break;
+    // Free the output buffer.
+    freeOut(z);
+
+    if (!written)
+	return ERRNO("write"), false;
+
+    updateStats(&out->frame0, z->fill, z->zsize, z->jumbo);
+    return true;
+}
+
+static int nameCmp(const void *n1, const void *n2)
+{
+    const struct name *name1 = n1, *name2 = n2;
+    if (name1->hash != name2->hash)
+	return name1->hash > name2->hash ? 1 : -1;
+    return name1->hdr > name2->hdr ? 1 : -1;
+}
+
+// Write the name index frame, sorted by hash.
+static bool writeNames(struct Out *out, const char *err[2])
+{
+    if (!out->nnames)
+	return true;
+    qsort(out->names, out->nnames, sizeof *out->names, nameCmp);
+    size_t size = out->nnames * 8 + 4;
+    unsigned *buf = malloc(8 + size);
+    if (!buf)
+	return ERRNO("malloc"), false;
+    buf[0] = htole32(0x184D2A59);
+    buf[1] = htole32(size);
+    for (size_t i = 0; i < out->nnames; i++) {
+	buf[2+2*i] = htole32(out->names[i].hash);
+	buf[3+2*i] = htole32(out->names[i].hdr);
+    }
+    buf[2+2*out->nnames] = buf[1];
+    bool written = xwrite(out->fd, buf, 8 + size);
+    free(buf);
+    if (!written)
+	return ERRNO("write"), false;
+    out->off += 8 + size;
+    return true;
+}
+
+// Write the index frame after the data frames.
+static bool writeIndex(struct Out *out, const char *err[2])
+{
+    // The entries are followed by the index frame's own offset
+    // and the size, so that the frame can be found from the end.
+    size_t size = out->nindex * sizeof *out->index + 12;
+    char *buf = malloc(8 + size);
+    if (!buf)
+	return ERRNO("malloc"), false;
+    unsigned frameHeader[] = {
+	htole32(0x184D2A58),
+	htole32(size),
+    };
+    memcpy(buf, frameHeader, 8);
+    memcpy(buf + 8, out->index, size - 12);
+    uint64_t off = htole64(out->off);
+    memcpy(buf + 8 + size - 12, &off, 8);
+    memcpy(buf + 8 + size - 4, &frameHeader[1], 4);
+    bool written = xwrite(out->fd, buf, 8 + size);
+    free(buf);
+    if (!written)
+	return ERRNO("write"), false;
+    return true;
+}
+
+// Finish the output: write the index frames, unless the index can't be
+// written, and rewrite the leading frame, which starts at pos0.  When
+// appending, the file is cut after the index frames (the old ones might
+// have been longer), and the leading frame is only updated after the rest
+// is on disk, so that it never covers the frames which are not.
+static bool writeTrailer(struct Out *out, off_t pos0, bool append, const char *err[2])
+{
+    // Write the name index and the index frame.
+    if (!out->noIndex) {
+	if (!writeNames(out, err))
+	    return false;
+	if (!writeIndex(out, err))
+	    return false;
+    }
+
+    if (append) {
+	off_t end = lseek(out->fd, 0, SEEK_CUR);
+	if (end < 0)
+	    return ERRNO("lseek"), false;
+	if (ftruncate(out->fd, end) < 0)
+	    return ERRNO("ftruncate"), false;
+	if (fsync(out->fd) < 0)
+	    return ERRNO("fsync"), false;
     }
 
     // Rewrite the leading frame.
-    frame0.total = htole64(frame0.total);
-    frame0.buf1size = htole32(frame0.buf1size);
-    frame0.jbufsize = htole32(frame0.jbufsize);
-    if (lseek(outfd, pos0, SEEK_SET) != 0)
+    struct frame0 frame0 = {
+	out->frame0.magic,
+	out->frame0.size16,
+	htole64(out->frame0.total),
+	htole32(out->frame0.buf1size),
+	htole32(out->frame0.jbufsize),
+    };
+    if (lseek(out->fd, pos0, SEEK_SET) != pos0)
+	return ERRNO("lseek"), false;
+    if (!xwrite(out->fd, &frame0, sizeof frame0))
+	return ERRNO("write"), false;
+    if (append && fsync(out->fd) < 0)
+	return ERRNO("fsync"), false;
+    return true;
+}
+
+// Multithreaded mode: the frames are read and written by the calling
+// thread, in order, using a ring of Z slots.  Worker threads pick up
+// the slots in the same order and compress the frames.
+struct MT {
+    pthread_mutex_t mutex;
+    pthread_cond_t workCond, doneCond;
+    struct Z **ring;
+    unsigned nring;
+    // The number of frames submitted, and taken up by the workers.
+    size_t submitted, taken;
+    bool quit;
+    pthread_t *tid;
+    int nthreads;
+};
+
+static void *worker(void *arg)
+{
+    struct MT *mt = arg;
+    pthread_mutex_lock(&mt->mutex);
+    while (1) {
+	while (!mt->quit && mt->taken == mt->submitted)
+	    pthread_cond_wait(&mt->workCond, &mt->mutex);
+	if (mt->quit)
+	    break;
+	struct Z *z = mt->ring[mt->taken++ % mt->nring];
+	pthread_mutex_unlock(&mt->mutex);
+	bool ok = compressFrame(z, z->err);
+	pthread_mutex_lock(&mt->mutex);
+	z->ok = ok;
+	z->done = true;
+	pthread_cond_broadcast(&mt->doneCond);
+    }
+    pthread_mutex_unlock(&mt->mutex);
+    return NULL;
+}
+
+// Wait for the frame in the slot to be compressed.
+static bool waitFrame(struct MT *mt, struct Z *z, const char *err[2])
+{
+    pthread_mutex_lock(&mt->mutex);
+    while (!z->done)
+	pthread_cond_wait(&mt->doneCond, &mt->mutex);
+    pthread_mutex_unlock(&mt->mutex);
+    if (!z->ok)
+	return err[0] = z->err[0], err[1] = z->err[1], false;
+    return true;
+}
+
+static void submitFrame(struct MT *mt, struct Z *z)
+{
+    pthread_mutex_lock(&mt->mutex);
+    z->done = false;
+    mt->submitted++;
+    pthread_cond_signal(&mt->workCond);
+    pthread_mutex_unlock(&mt->mutex);
+}
+
+// Stop the threads, free the ring.
+static void freeMT(struct MT *mt)
+{
+    pthread_mutex_lock(&mt->mutex);
+    mt->quit = true;
+    pthread_cond_broadcast(&mt->workCond);
+    pthread_mutex_unlock(&mt->mutex);
+    for (int i = 0; i < mt->nthreads; i++)
+	pthread_join(mt->tid[i], NULL);
+    for (unsigned i = 0; mt->ring && i < mt->nring; i++)
+	freeZ(mt->ring[i]);
+    free(mt->ring);
+    free(mt->tid);
+    pthread_mutex_destroy(&mt->mutex);
+    pthread_cond_destroy(&mt->workCond);
+    pthread_cond_destroy(&mt->doneCond);
+}
+
+// Runs the frames through the ring, returns the number of headers
+// processed, or -1 on error.  The first frame has already been read
+// into ring[0].
+static ssize_t compressMT(struct In *in, size_t nhdr0, struct Out *out,
+			  struct MT *mt, const char *err[2])
+{
+    size_t nhdr = nhdr0;
+    size_t nframes = 0;
+    struct Z *z = mt->ring[0];
+    while (1) {
+	submitFrame(mt, z);
+	nframes++;
+	z = mt->ring[nframes % mt->nring];
+	// The slot is still busy with an earlier frame?  Write it out.
+	if (nframes >= mt->nring) {
+	    if (!waitFrame(mt, z, err))
+		return -1;
+	    if (!writeFrame(out, z, err))
+		return -1;
+	}
+	int n = readFrame(in, z, err);
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	    break;
+	nhdr += n;
+    }
+    // Drain the ring, in order.
+    size_t i = nframes >= mt->nring ? nframes - mt->nring + 1 : 0;
+    for (; i < nframes; i++) {
+	z = mt->ring[i % mt->nring];
+	if (!waitFrame(mt, z, err))
+	    return -1;
+	if (!writeFrame(out, z, err))
+	    return -1;
+    }
+    return nhdr;
+}
+
+// Append mode: load the index frames of the existing file (its data starts
+// at pos0, and ends at end), and find the end of the data frames, where
+// the new frames will be written; only the index frames may follow.
+// Returns the offset of the end, relative to the leading frame, -1 on error.
+static int64_t loadTrailer(struct Out *out, off_t pos0, off_t end, const char *err[2])
+{
+    int fd = out->fd;
+    ssize_t ret;
+    // Where the index frames start, if any.
+    int64_t trailer = end;
+    // The index frame ends with its size.
+    unsigned size;
+    if (end - 4 >= (off_t) sizeof out->frame0 &&
+	(ret = pread(fd, &size, 4, pos0 + end - 4)) == 4 &&
+	(size = le32toh(size)) >= 12 && (size - 12) % 16 == 0 &&
+	size <= end - 8 - (off_t) sizeof out->frame0)
+    {
+	off_t ipos = end - 8 - size;
+	char *buf = malloc(8 + (size_t) size);
+	if (!buf)
+	    return ERRNO("malloc"), -1;
+	ret = pread(fd, buf, 8 + (size_t) size, pos0 + ipos);
+	if (ret < 0)
+	    return free(buf), ERRNO("pread"), -1;
+	unsigned frameHeader[2] = { 0 };
+	uint64_t ioff = 0;
+	if (ret == 8 + (size_t) size) {
+	    memcpy(frameHeader, buf, 8);
+	    memcpy(&ioff, buf + 8 + size - 12, 8);
+	}
+	// The frame records its own offset, otherwise it's not an index.
+	if (frameHeader[0] == htole32(0x184D2A58) &&
+	    le32toh(frameHeader[1]) == size && le64toh(ioff) == ipos)
+	{
+	    // The entries are kept in the little-endian order.
+	    size_t n = (size - 12) / 16;
+	    memmove(buf, buf + 8, n * sizeof *out->index);
+	    out->index = (void *) buf;
+	    out->nindex = out->maxindex = n;
+	    trailer = ipos;
+	    // The name index frame, if any, comes right before the index frame.
+	    if (ipos - 4 >= (off_t) sizeof out->frame0 &&
+		pread(fd, &size, 4, pos0 + ipos - 4) == 4 &&
+		(size = le32toh(size)) >= 4 && (size - 4) % 8 == 0 &&
+		size <= ipos - 8 - (off_t) sizeof out->frame0)
+	    {
+		off_t npos = ipos - 8 - size;
+		unsigned *nbuf = malloc(8 + (size_t) size);
+		if (!nbuf)
+		    return ERRNO("malloc"), -1;
+		ret = pread(fd, nbuf, 8 + (size_t) size, pos0 + npos);
+		if (ret < 0)
+		    return free(nbuf), ERRNO("pread"), -1;
+		if (ret == 8 + (size_t) size && nbuf[0] == htole32(0x184D2A59) &&
+		    le32toh(nbuf[1]) == size)
+		{
+		    // The names are kept in the native order.
+		    size_t n = (size - 4) / 8;
+		    struct name *names = (void *) nbuf;
+		    for (size_t i = 0; i < n; i++)
+			names[i] = (struct name) { le32toh(nbuf[2+2*i]), le32toh(nbuf[3+2*i]) };
+		    out->names = names;
+		    out->nnames = out->maxnames = n;
+		    trailer = npos;
+		}
+		else
+		    free(nbuf);
+	    }
+	}
+	else
+	    free(buf);
+    }
+
+    // No index, the data frames will be walked.  A new index can't be
+    // written, since the number of headers in the frames is not known.
+    if (!out->index)
+	out->noIndex = true;
+
+    // Find the end of the data frames.  With the index, the last frame
+    // is found right away.
+    unsigned lead[3];
+    int64_t off = sizeof out->frame0 + sizeof rpmhdrzdict;
+    if (out->nindex) {
+	off = le64toh(out->index[out->nindex-1].off);
+	ret = pread(fd, lead, 8, pos0 + off);
+	if (ret < 0)
+	    return ERRNO("pread"), -1;
+	if (ret != 8 || lead[0] != dataMagic(out->zstd))
+	    return ERRSTR("bad index"), -1;
+	off += 8 + le32toh(lead[1]);
+    }
+    else while (off + 12 <= end) {
+	ret = pread(fd, lead, 12, pos0 + off);
+	if (ret < 0)
+	    return ERRNO("pread"), -1;
+	if (ret != 12 || lead[0] != dataMagic(out->zstd))
+	    break;
+	off += 8 + le32toh(lead[1]);
+    }
+    if (off > trailer)
+	return ERRSTR("unexpected EOF"), -1;
+    // Anything else after the data frames, such as another concatenated
+    // stream, would be overwritten by the new frames.
+    if (off != trailer)
+	return ERRSTR("trailing data after the list"), -1;
+    return off;
+}
+
+// Append mode: check the leading frame and the dictionary of the existing
+// file, and position the output after the data frames.  The leading frame
+// is loaded into out->frame0.  Returns false on error.
+static bool openAppend(struct Out *out, off_t pos0, const char *err[2])
+{
+    int fd = out->fd;
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+	return ERRNO("fstat"), false;
+    if (!S_ISREG(st.st_mode))
+	return ERRSTR("not a regular file"), false;
+    struct frame0 *frame0 = &out->frame0;
+    ssize_t ret = pread(fd, frame0, sizeof *frame0, pos0);
+    if (ret < 0)
+	return ERRNO("pread"), false;
+    if (ret != sizeof *frame0)
+	return ERRSTR("unexpected EOF"), false;
+    if (frame0->magic != htole32(0x184D2A55) || frame0->size16 != htole32(16))
+	return ERRSTR("bad leading frame"), false;
+    frame0->total = le64toh(frame0->total);
+    frame0->buf1size = le32toh(frame0->buf1size);
+    frame0->jbufsize = le32toh(frame0->jbufsize);
+
+    // Empty list, no dictionary yet.
+    int64_t off = sizeof *frame0;
+    if (frame0->total) {
+	// The new frames are compressed with the same dictionary,
+	// and with the same codec.
+	char dict[sizeof rpmhdrzdict];
+	ret = pread(fd, dict, sizeof dict, pos0 + off);
+	if (ret < 0)
+	    return ERRNO("pread"), false;
+	bool zstd;
+	if (ret != sizeof dict || !checkDict(dict, &zstd))
+	    return ERRSTR("dictionary mismatch"), false;
+	if (zstd != out->zstd)
+	    return ERRSTR("codec mismatch"), false;
+	off = loadTrailer(out, pos0, st.st_size - pos0, err);
+	if (off < 0)
+	    return false;
+    }
+    else {
+	// Nor are there index frames, and nothing else may follow.
+	out->noIndex = true;
+	if (st.st_size - pos0 != off)
+	    return ERRSTR("trailing data after the list"), false;
+    }
+    if (lseek(fd, pos0 + off, SEEK_SET) < 0)
+	return ERRNO("lseek"), false;
+    out->off = off;
+    return true;
+}
+
+ssize_t zpkglistCompress2(int infd, int outfd,
+			  void (*hash)(const void *buf, size_t size, void *arg),
+			  void *arg, const struct zpkglistCompressOptions *opt,
+			  const char *err[2])
+{
+    struct zpkglistCompressOptions opt0 = { 0 };
+    if (!opt)
+	opt = &opt0;
+    int nthreads = opt->nthreads;
+    bool append = opt->append;
+    if (opt->level < 0 || opt->level > (opt->zstd ? ZSTD_maxCLevel() : LZ4HC_CLEVEL_MAX))
+	return ERRSTR("bad compression level"), -1;
+    if (opt->accel < 0 || (opt->accel > 1 && (opt->level || opt->zstd)))
+	return ERRSTR("bad acceleration factor"), -1;
+    if (nthreads < 1) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = n > 0 ? n : 1;
+    }
+
+    // Get the initial file position, will seek back.
+    off_t pos0 = lseek(outfd, 0, SEEK_CUR);
+    if (pos0 < 0)
 	return ERRNO("lseek"), -1;
-    if (!xwrite(outfd, &frame0, sizeof frame0))
-	return ERRNO("write"), -1;
+
+    // Prepare the leading frame.
+    struct Out out = { outfd, !opt->index, { htole32(0x184D2A55), htole32(16), 0, 0, 0 } };
+    struct frame0 *frame0 = &out.frame0;
+    out.zstd = opt->zstd;
+
+    if (append) {
+	// The file has the say, see loadTrailer.
+	out.noIndex = false;
+	if (!openAppend(&out, pos0, err))
+	    return free(out.index), free(out.names), -1;
+    }
+    else {
+	// Write the leading frame, to be rewritten later.
+	if (!xwrite(outfd, frame0, sizeof *frame0))
+	    return ERRNO("write"), -1;
+	out.off = sizeof *frame0;
+    }
+
+    // Open the input.
+    struct In in = { .hash = hash, .arg = arg, .names = !out.noIndex };
+    int rc = zpkglistFdopen(&in.z, infd, err);
+    if (rc <= 0)
+	return free(out.index), free(out.names), rc;
+
+    // The input has been opened, and must be closed upon return.  I understand
+    // C++ can overload operators, but can it overload operator return?
+    ZSTD_CDict *cdict = NULL;
+#define freez (void)0
+#define freemt (void)0
+#define return return zpkglistFree(in.z), free(out.index), free(out.names), freez, freemt, \
+		      ZSTD_freeCDict(cdict),
+
+    // Load the leading bytes of the first header: 8 magic + 8 (il,dl).
+    ssize_t ret = zpkglistRead(in.z, in.lead, 16, err);
+    // If it's EOF or an error, do nothing.
+    if (ret <= 0)
+	return ret;
+    if (ret < 16)
+	return ERRSTR("unexpected EOF"), -1;
+    if (!headerCheckMagic(in.lead))
+	return ERRSTR("bad header magic"), -1;
+
+    // The size of the header's data after (il,dl).
+    in.dataSize = headerDataSize(in.lead);
+    if (in.dataSize < 0)
+	return ERRSTR("bad header size"), -1;
+
+    // Write the dictionary frame, unless appending to a non-empty list.
+    if (!frame0->total) {
+	if (!writeDict(&out, err))
+	    return -1;
+
+	// Set buf1size to zdict size (not including the frame header).
+	frame0->buf1size = sizeof rpmhdrzdict - 8;
+    }
+
+    // With zstd, the dictionary is loaded once for all threads.
+    int level = opt->level;
+    if (opt->zstd) {
+	if (!level)
+	    level = ZSTD_CLEVEL_DEFAULT;
+	cdict = newCDict(level);
+	if (!cdict)
+	    return ERROR("ZSTD_createCDict", "cannot load dictionary"), -1;
+    }
+
+    // Allocate and initialize the compressor state.
+    struct Z *z = newZ(level, opt->accel, cdict);
+    if (!z)
+	return ERRNO("malloc"), -1;
+
+    // Or can C++ overload operators twice in the same scope?
+    // Or can it draw out Leviathan with an hook?
+#undef freez
+#define freez freeZ(z)
+
+    // The number of headers processed (the return value).
+    size_t nhdr = 0;
+
+    // Read the first frame.  If it's the only frame, there's no point
+    // in starting the threads.
+    int n = readFrame(&in, z, err);
+    if (n < 0)
+	return -1;
+    assert(n > 0);
+    nhdr += n;
+
+    if (nthreads > 1 && !in.eof) {
+	// Two slots per thread: while a thread is compressing a frame,
+	// the next frame can be read in.
+	struct MT mt = {
+	    PTHREAD_MUTEX_INITIALIZER,
+	    PTHREAD_COND_INITIALIZER,
+	    PTHREAD_COND_INITIALIZER,
+	    .nring = 2 * nthreads,
+	};
+	mt.ring = calloc(mt.nring, sizeof *mt.ring);
+	mt.tid = malloc(nthreads * sizeof *mt.tid);
+#undef freemt
+#define freemt freeMT(&mt)
+	if (!mt.ring || !mt.tid)
+	    return ERRNO("malloc"), -1;
+	mt.ring[0] = z, z = NULL;
+	for (unsigned i = 1; i < mt.nring; i++) {
+	    mt.ring[i] = newZ(level, opt->accel, cdict);
+	    if (!mt.ring[i])
+		return ERRNO("malloc"), -1;
+	}
+	for (; mt.nthreads < nthreads; mt.nthreads++) {
+	    int rc = pthread_create(&mt.tid[mt.nthreads], NULL, worker, &mt);
+	    if (rc)
+		return errno = rc, ERRNO("pthread_create"), -1;
+	}
+	ret = compressMT(&in, nhdr, &out, &mt, err);
+	if (ret < 0)
+	    return -1;
+	nhdr = ret;
+	// Done with the threads.
+	freemt;
+#undef freemt
+#define freemt (void)0
+    }
+    else {
+	while (1) {
+	    if (!compressFrame(z, err))
+		return -1;
+	    if (!writeFrame(&out, z, err))
+		return -1;
+	    n = readFrame(&in, z, err);
+	    if (n < 0)
+		return -1;
+	    if (n == 0)
+		break;
+	    nhdr += n;
+	}
+    }
+
+    if (!writeTrailer(&out, pos0, append, err))
+	return -1;
 
     // God knows how hard it is to trigger this assetion.
     assert(nhdr > 0 && nhdr < SSIZE_MAX);
     return nhdr;
 }
+
+#undef return
+#undef freez
+#undef freemt
+
+ssize_t zpkglistCompressMT(int infd, int outfd,
+			   void (*hash)(const void *buf, size_t size, void *arg),
+			   void *arg, int nthreads, const char *err[2])
+{
+    struct zpkglistCompressOptions opt = { .nthreads = nthreads };
+    return zpkglistCompress2(infd, outfd, hash, arg, &opt, err);
+}
+
+ssize_t zpkglistAppend(int infd, int outfd,
+		       void (*hash)(const void *buf, size_t size, void *arg),
+		       void *arg, int nthreads, const char *err[2])
+{
+    struct zpkglistCompressOptions opt = { .nthreads = nthreads, .append = true };
+    return zpkglistCompress2(infd, outfd, hash, arg, &opt, err);
+}
+
+ssize_t zpkglistCompress(int infd, int outfd,
+			 void (*hash)(const void *buf, size_t size, void *arg),
+			 void *arg, const char *err[2])
+{
+    return zpkglistCompressMT(infd, outfd, hash, arg, 1, err);
+}
+
+// Merging and splitting: the data frames of existing zpkglists are copied
+// verbatim, only the leading frame and the index frames are rebuilt.
+struct Src {
+    struct fda fda;
+    // The frame being copied, along with the frame header.
+    char *buf;
+    size_t bufsize;
+    // The leading frame of the current stream, host order, where
+    // it starts, and the uncompressed size of its data frames read so far.
+    struct frame0 frame0;
+    off_t pos0;
+    uint64_t total;
+    // The frames are compressed with zstd.
+    bool zstd;
+    // Where the data frames of the current stream went: the output,
+    // and the frame number in the output; and where they came from
+    // (the offset in the stream, and the uncompressed size), which
+    // the source's index must match.
+    struct dst {
+	struct Out *out;
+	size_t frame;
+	uint64_t off;
+	unsigned size;
+    } *dst;
+    size_t ndst, maxdst;
+    char fdabuf[NREADA];
+};
+
+static struct Src *newSrc(int fd, const char *err[2])
+{
+    struct Src *src = malloc(sizeof *src);
+    if (!src)
+	return ERRNO("malloc"), NULL;
+    src->bufsize = (128<<10) + LZ4_COMPRESSBOUND(128<<10) + 12;
+    src->buf = malloc(src->bufsize);
+    if (!src->buf)
+	return free(src), ERRNO("malloc"), NULL;
+    src->fda = (struct fda) { fd, src->fdabuf };
+    src->dst = NULL;
+    src->ndst = src->maxdst = 0;
+    return src;
+}
+
+static void freeSrc(struct Src *src)
+{
+    if (!src)
+	return;
+    free(src->buf);
+    free(src->dst);
+    free(src);
+}
+
+// Read exactly size bytes into src->buf.
+static bool srcRead(struct Src *src, size_t size, const char *err[2])
+{
+    if (size > src->bufsize) {
+	char *buf = realloc(src->buf, size);
+	if (!buf)
+	    return ERRNO("realloc"), false;
+	src->buf = buf, src->bufsize = size;
+    }
+    ssize_t ret = reada(&src->fda, src->buf, size);
+    if (ret < 0)
+	return ERRNO("read"), false;
+    if (ret != size)
+	return ERRSTR("unexpected EOF"), false;
+    return true;
+}
+
+// Read the leading frame and the dictionary of the next stream.
+// Returns 1 on success, 0 on EOF, -1 on error.
+static int srcBegin(struct Src *src, const char *err[2])
+{
+    src->ndst = 0;
+    src->total = 0;
+    src->pos0 = tella(&src->fda);
+    struct frame0 *frame0 = &src->frame0;
+    ssize_t ret = reada(&src->fda, frame0, sizeof *frame0);
+    if (ret < 0)
+	return ERRNO("read"), -1;
+    if (ret == 0)
+	return 0;
+    if (ret != sizeof *frame0)
+	return ERRSTR("unexpected EOF"), -1;
+    if (frame0->magic != htole32(0x184D2A55))
+	return ERRSTR("bad zpkglist magic"), -1;
+    if (frame0->size16 != htole32(16))
+	return ERRSTR("bad zpkglist frame size"), -1;
+    frame0->total = le64toh(frame0->total);
+    frame0->buf1size = le32toh(frame0->buf1size);
+    frame0->jbufsize = le32toh(frame0->jbufsize);
+    // The sizes bound the data frames, see srcNext; validated as in zreader.
+    if (!frame0->buf1size ^ !frame0->total ||
+	frame0->jbufsize > headerMaxSize || frame0->jbufsize > frame0->total ||
+	(frame0->buf1size > (128<<10) + LZ4_COMPRESSBOUND(128<<10) &&
+	 frame0->buf1size > LZ4_COMPRESSBOUND(frame0->jbufsize)))
+	return ERRSTR("bad zpkglist frame sizes"), -1;
+    // Empty list, no dictionary.
+    src->zstd = false;
+    if (!frame0->total)
+	return 1;
+    // The frames can only be copied if compressed with the same dictionary.
+    if (!srcRead(src, sizeof rpmhdrzdict, err))
+	return -1;
+    if (!checkDict(src->buf, &src->zstd))
+	return ERRSTR("dictionary mismatch"), -1;
+    return 1;
+}
+
+// Read the next data frame into src->buf.  Returns the size of the frame,
+// including the frame header, 0 after the last data frame, -1 on error.
+static ssize_t srcNext(struct Src *src, const char *err[2])
+{
+    unsigned lead[3];
+    ssize_t ret = peeka(&src->fda, lead, 12);
+    if (ret < 0)
+	return ERRNO("read"), -1;
+    if (ret < 4 || lead[0] != dataMagic(src->zstd)) {
+	if (src->total != src->frame0.total)
+	    return ERRSTR("bad contentSize"), -1;
+	return 0;
+    }
+    if (ret != 12)
+	return ERRSTR("unexpected EOF"), -1;
+    size_t zsize = le32toh(lead[1]) - 4;
+    size_t size = le32toh(lead[2]);
+    if (!size)
+	return ERRSTR("bad data size"), -1;
+    if (le32toh(lead[1]) <= 4 ||
+	zsize > (src->zstd ? ZSTD_COMPRESSBOUND(size) : LZ4_COMPRESSBOUND(size)))
+	return ERRSTR("bad data zsize"), -1;
+    // The leading frame bounds the buffer size.
+    if (size > (128<<10)) {
+	if (size > src->frame0.jbufsize)
+	    return ERRSTR("bad data size"), -1;
+	if (zsize > src->frame0.buf1size)
+	    return ERRSTR("bad data zsize"), -1;
+    }
+    else if (size + zsize > src->frame0.buf1size)
+	return ERRSTR("bad data size+zsize"), -1;
+    src->total += 8 + size;
+    if (src->total > src->frame0.total)
+	return ERRSTR("bad data size"), -1;
+    if (!srcRead(src, 12 + zsize, err))
+	return -1;
+    return 12 + zsize;
+}
+
+// Write the data frame from src->buf to the output, and update the stats.
+static bool copyFrame(struct Src *src, size_t n, struct Out *out, const char *err[2])
+{
+    // The first frame goes after the dictionary.  The codec can't be mixed.
+    if (!out->frame0.total) {
+	out->zstd = src->zstd;
+	if (!writeDict(out, err))
+	    return false;
+	out->frame0.buf1size = sizeof rpmhdrzdict - 8;
+    }
+    else if (out->zstd != src->zstd)
+	return ERRSTR("codec mismatch"), false;
+
+    // Register the frame with the index.  The number of headers
+    // is yet unknown, will be filled from the source's index.
+    if (out->nindex == out->maxindex) {
+	size_t maxindex = out->maxindex ? 2 * out->maxindex : 1024;
+	struct indexEntry *index = realloc(out->index, maxindex * sizeof *index);
+	if (!index)
+	    return ERRNO("realloc"), false;
+	out->index = index, out->maxindex = maxindex;
+    }
+    unsigned size;
+    memcpy(&size, src->buf + 8, 4);
+    out->index[out->nindex++] = (struct indexEntry) { htole64(out->off), size, 0 };
+    size = le32toh(size);
+
+    // Remember where it went.
+    if (src->ndst == src->maxdst) {
+	size_t maxdst = src->maxdst ? 2 * src->maxdst : 1024;
+	struct dst *dst = realloc(src->dst, maxdst * sizeof *dst);
+	if (!dst)
+	    return ERRNO("realloc"), false;
+	src->dst = dst, src->maxdst = maxdst;
+    }
+    src->dst[src->ndst++] = (struct dst) {
+	out, out->nindex - 1, tella(&src->fda) - n - src->pos0, size,
+    };
+
+    if (!xwrite(out->fd, src->buf, n))
+	return ERRNO("write"), false;
+    out->off += n;
+    updateStats(&out->frame0, size, n - 12, size > (128<<10));
+    return true;
+}
+
+// The source has no index, or it can't be trusted: nor will the outputs
+// have the index.
+static void srcNoIndex(struct Src *src)
+{
+    for (size_t i = 0; i < src->ndst; i++)
+	src->dst[i].out->noIndex = true;
+}
+
+// Read the index frames after the data frames, and pass the names and
+// the number of headers in each frame on to the outputs.  If there is
+// no index, the outputs won't have it either.
+static bool srcTrailer(struct Src *src, const char *err[2])
+{
+    unsigned lead[2];
+    ssize_t ret = peeka(&src->fda, lead, 8);
+    if (ret < 0)
+	return ERRNO("read"), false;
+
+    // The name index frame, if any, comes first.
+    struct name *names = NULL;
+    size_t nnames = 0;
+    if (ret == 8 && lead[0] == htole32(0x184D2A59)) {
+	size_t size = le32toh(lead[1]);
+	if (size < 4 || (size - 4) % 8)
+	    return ERRSTR("bad names frame size"), false;
+	if (!srcRead(src, 8 + size, err))
+	    return false;
+	nnames = (size - 4) / 8;
+	names = malloc(nnames * sizeof *names + 1);
+	if (!names)
+	    return ERRNO("malloc"), false;
+	unsigned *w = (unsigned *) src->buf;
+	for (size_t i = 0; i < nnames; i++) {
+	    names[i] = (struct name) { le32toh(w[2+2*i]), le32toh(w[3+2*i]) };
+	    if ((names[i].hdr >> 2) >= src->ndst)
+		return free(names), ERRSTR("bad names frame"), false;
+	}
+	ret = peeka(&src->fda, lead, 8);
+	if (ret < 0)
+	    return free(names), ERRNO("read"), false;
+    }
+
+    // No index, no names.
+    if (ret < 8 || lead[0] != htole32(0x184D2A58)) {
+	srcNoIndex(src);
+	free(names);
+	return true;
+    }
+
+    size_t size = le32toh(lead[1]);
+    if (size < 12 || (size - 12) % 16 || (size - 12) / 16 != src->ndst)
+	return free(names), ERRSTR("bad index frame size"), false;
+    uint64_t ipos = tella(&src->fda) - src->pos0;
+    if (!srcRead(src, 8 + size, err))
+	return free(names), false;
+
+    // The index must describe the frames just copied, which add up to
+    // the total; a stale or corrupt index is not passed on.
+    uint64_t total = 0, ioff;
+    bool valid = true;
+    for (size_t i = 0; valid && i < src->ndst; i++) {
+	struct indexEntry e;
+	memcpy(&e, src->buf + 8 + 16 * i, 16);
+	unsigned fill = le32toh(e.size), nhdr = le32toh(e.nhdr);
+	valid = le64toh(e.off) == src->dst[i].off && fill == src->dst[i].size &&
+		nhdr >= 1 && nhdr <= (fill > (128<<10) ? 1 : 4);
+	total += 8 + fill;
+    }
+    memcpy(&ioff, src->buf + 8 + size - 12, 8);
+    // A name must refer to one of the frame's headers.
+    for (size_t i = 0; valid && i < nnames; i++) {
+	unsigned nhdr;
+	memcpy(&nhdr, src->buf + 8 + 16 * (names[i].hdr >> 2) + 12, 4);
+	valid = (names[i].hdr & 3) < le32toh(nhdr);
+    }
+    if (!valid || total != src->frame0.total || le64toh(ioff) != ipos) {
+	srcNoIndex(src);
+	free(names);
+	return true;
+    }
+    for (size_t i = 0; i < src->ndst; i++) {
+	struct dst *dst = &src->dst[i];
+	memcpy(&dst->out->index[dst->frame].nhdr, src->buf + 8 + 16 * i + 12, 4);
+    }
+    for (size_t i = 0; i < nnames; i++) {
+	struct dst *dst = &src->dst[names[i].hdr >> 2];
+	struct Out *out = dst->out;
+	if (out->nnames == out->maxnames) {
+	    size_t maxnames = out->maxnames ? 2 * out->maxnames : 4096;
+	    struct name *onames = realloc(out->names, maxnames * sizeof *onames);
+	    if (!onames)
+		return free(names), ERRNO("realloc"), false;
+	    out->names = onames, out->maxnames = maxnames;
+	}
+	out->names[out->nnames++] = (struct name) {
+	    names[i].hash, dst->frame << 2 | (names[i].hdr & 3),
+	};
+    }
+    free(names);
+    return true;
+}
+
+// Start the output: write the leading frame, to be rewritten later.
+static bool beginOut(struct Out *out, int fd, off_t *pos0, const char *err[2])
+{
+    *out = (struct Out) { fd, false, { htole32(0x184D2A55), htole32(16), 0, 0, 0 } };
+    *pos0 = lseek(fd, 0, SEEK_CUR);
+    if (*pos0 < 0)
+	return ERRNO("lseek"), false;
+    if (!xwrite(fd, &out->frame0, sizeof out->frame0))
+	return ERRNO("write"), false;
+    out->off = sizeof out->frame0;
+    return true;
+}
+
+ssize_t zpkglistMerge(int outfd, const int *infds, size_t n, const char *err[2])
+{
+    struct Out out;
+    off_t pos0;
+    if (!beginOut(&out, outfd, &pos0, err))
+	return -1;
+    struct Src *src = newSrc(-1, err);
+    if (!src)
+	return -1;
+
+#define return return freeSrc(src), free(out.index), free(out.names),
+
+    size_t nframes = 0;
+    for (size_t i = 0; i < n; i++) {
+	src->fda = (struct fda) { infds[i], src->fdabuf };
+	int rc;
+	// Concatenated streams are merged, too.
+	while ((rc = srcBegin(src, err)) > 0) {
+	    ssize_t size;
+	    while ((size = srcNext(src, err)) > 0) {
+		if (!copyFrame(src, size, &out, err))
+		    return -1;
+		nframes++;
+	    }
+	    if (size < 0)
+		return -1;
+	    if (!srcTrailer(src, err))
+		return -1;
+	}
+	if (rc < 0)
+	    return -1;
+    }
+
+    // All the inputs are empty, the leading frame is as good as it gets.
+    if (!nframes)
+	return 0;
+
+    if (!writeTrailer(&out, pos0, false, err))
+	return -1;
+    return nframes;
+}
+
+#undef return
+
+static void freeOuts(struct Out *outs, size_t k)
+{
+    if (!outs)
+	return;
+    for (size_t i = 0; i < k; i++)
+	free(outs[i].index), free(outs[i].names);
+    free(outs);
+}
+
+ssize_t zpkglistSplit(int infd, const int *outfds, size_t k, const char *err[2])
+{
+    if (k < 1)
+	return ERRSTR("bad number of shards"), -1;
+    struct Out *outs = calloc(k, sizeof *outs);
+    off_t *pos0 = malloc(k * sizeof *pos0 + 1);
+    struct Src *src = newSrc(infd, err);
+
+#define return return freeOuts(outs, k), free(pos0), freeSrc(src),
+
+    if (!outs || !pos0)
+	return ERRNO("malloc"), -1;
+    if (!src)
+	return -1;
+    for (size_t i = 0; i < k; i++)
+	if (!beginOut(&outs[i], outfds[i], &pos0[i], err))
+	    return -1;
+
+    // Empty input, empty shards.
+    int rc = srcBegin(src, err);
+    if (rc <= 0)
+	return rc;
+
+    // Balance the shards by the uncompressed size: a frame goes to
+    // the shard which covers the frame's midpoint.
+    uint64_t total = src->frame0.total, done = 0;
+    if (!total) {
+	// An empty list, but frames follow (rather than EOF or the next
+	// stream's leading frame)?
+	unsigned magic;
+	ssize_t ret = peeka(&src->fda, &magic, 4);
+	if (ret < 0)
+	    return ERRNO("read"), -1;
+	if (ret > 0 && (ret < 4 || magic != htole32(0x184D2A55)))
+	    return ERRSTR("bad contentSize"), -1;
+    }
+    size_t nframes = 0;
+    ssize_t size;
+    while ((size = srcNext(src, err)) > 0) {
+	unsigned fill;
+	memcpy(&fill, src->buf + 8, 4);
+	fill = 8 + le32toh(fill);
+	size_t i = (done + fill / 2) * k / total;
+	if (i >= k)
+	    i = k - 1;
+	done += fill;
+	if (!copyFrame(src, size, &outs[i], err))
+	    return -1;
+	nframes++;
+    }
+    if (size < 0)
+	return -1;
+    if (!srcTrailer(src, err))
+	return -1;
+
+    // The shards are balanced against the first stream.
+    char c;
+    ssize_t ret = peeka(&src->fda, &c, 1);
+    if (ret < 0)
+	return ERRNO("read"), -1;
+    if (ret > 0)
+	return ERRSTR("concatenated input not supported"), -1;
+
+    for (size_t i = 0; i < k; i++)
+	if (outs[i].frame0.total && !writeTrailer(&outs[i], pos0[i], false, err))
+	    return -1;
+    return nframes;
+}
+
+#undef return
@@ -60,3 +60,37 @@ static inline ssize_t headerDataSize(unsigned lead[4])
     if (dl - 1 > headerMaxData - 1) return -1;
     return 16 * il + dl;
 }
+
+// Find a string tag, such as RPMTAG_NAME, in a header blob (which starts
+// with <il,dl>, without the magic).  The blob is assumed to be of valid size.
+// Returns NULL if the tag is not found, or if the string is malformed.
+static inline const char *headerGetString(const void *blob, int tag)
+{
+    const unsigned *ei = blob;
+    unsigned il = ntohl(ei[0]);
+    unsigned dl = ntohl(ei[1]);
+    const unsigned *ee = ei + 2;
+    const char *data = (const char *) (ee + 4 * il);
+    for (unsigned i = 0; i < il; i++, ee += 4) {
+	if (ntohl(ee[0]) != tag)
+	    continue;
+	// RPM_STRING_TYPE or RPM_I18NSTRING_TYPE.
+	unsigned type = ntohl(ee[1]);
+	if (type != 6 && type != 9)
+	    return NULL;
+	unsigned off = ntohl(ee[2]);
+	if (off >= dl || !memchr(data + off, '\0', dl - off))
+	    return NULL;
+	return data + off;
+    }
+    return NULL;
+}
+
+// The hash function for the name index (32-bit FNV-1a).
+static inline unsigned headerNameHash(const char *s)
+{
+    unsigned h = 2166136261;
+    while (*s)
+	h = (h ^ (unsigned char) *s++) * 16777619;
+    return h;
+}
@@ -0,0 +1,126 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <lz4frame.h>
+#include "lz4reader.h"
+#include "reada.h"
+#include "error.h"
+
+struct lz4reader {
+    struct fda *fda;
+    LZ4F_dctx *dctx;
+    // The end of the frame has been reached.
+    bool eof;
+    int64_t contentSize;
+};
+
+// Make sure there is some compressed data in the readahead buffer,
+// which is then fed to LZ4F_decompress directly.  Returns the number
+// of bytes available, 0 on EOF, -1 on error.
+static ssize_t lz4reader_fill(struct fda *fda)
+{
+    if (fda->cur == fda->end && filla(fda, 1) < 0)
+	return -1;
+    return fda->end - fda->cur;
+}
+
+static int lz4reader_begin(struct lz4reader *z, const char *err[2])
+{
+    LZ4F_resetDecompressionContext(z->dctx);
+    z->eof = false;
+    z->contentSize = -1;
+    // The frame header is at most 19 bytes.  LZ4F_getFrameInfo consumes it,
+    // and insists on getting the whole of it.
+    ssize_t n = filla(z->fda, LZ4F_HEADER_SIZE_MAX);
+    if (n < 0)
+	return ERRNO("read"), -1;
+    if (n == 0)
+	return 0;
+    LZ4F_frameInfo_t info;
+    size_t srcSize = z->fda->end - z->fda->cur;
+    size_t ret = LZ4F_getFrameInfo(z->dctx, &info, z->fda->cur, &srcSize);
+    if (LZ4F_isError(ret))
+	return ERROR("LZ4F_getFrameInfo", LZ4F_getErrorName(ret)), -1;
+    z->fda->cur += srcSize;
+    if (info.contentSize)
+	z->contentSize = info.contentSize;
+    return 1;
+}
+
+int lz4reader_open(struct lz4reader **zp, struct fda *fda, const char *err[2])
+{
+    struct lz4reader *z = malloc(sizeof *z);
+    if (!z)
+	return ERRNO("malloc"), -1;
+    z->fda = fda;
+    size_t ret = LZ4F_createDecompressionContext(&z->dctx, LZ4F_VERSION);
+    if (LZ4F_isError(ret))
+	return free(z), ERROR("LZ4F_createDecompressionContext", LZ4F_getErrorName(ret)), -1;
+    int rc = lz4reader_begin(z, err);
+    if (rc <= 0)
+	return lz4reader_free(z), rc;
+    *zp = z;
+    return rc;
+}
+
+int lz4reader_reopen(struct lz4reader *z, struct fda *fda, const char *err[2])
+{
+    z->fda = fda;
+    return lz4reader_begin(z, err);
+}
+
+void lz4reader_free(struct lz4reader *z)
+{
+    if (!z)
+	return;
+    LZ4F_freeDecompressionContext(z->dctx);
+    free(z);
+}
+
+ssize_t lz4reader_read(struct lz4reader *z, void *buf, size_t size, const char *err[2])
+{
+    size_t total = 0;
+    while (size && !z->eof) {
+	ssize_t n = lz4reader_fill(z->fda);
+	if (n < 0)
+	    return ERRNO("read"), -1;
+	if (n == 0)
+	    return ERRSTR("unexpected EOF"), -1;
+	// Decompress right from the readahead buffer.
+	size_t dstSize = size, srcSize = n;
+	size_t ret = LZ4F_decompress(z->dctx, buf, &dstSize, z->fda->cur, &srcSize, NULL);
+	if (LZ4F_isError(ret))
+	    return ERROR("LZ4F_decompress", LZ4F_getErrorName(ret)), -1;
+	z->fda->cur += srcSize;
+	buf = (char *) buf + dstSize;
+	size -= dstSize, total += dstSize;
+	// The end of the frame, the next one might follow.
+	if (ret == 0)
+	    z->eof = true;
+    }
+    return total;
+}
+
+int64_t lz4reader_contentSize(struct lz4reader *z)
+{
+    return z->contentSize;
+}
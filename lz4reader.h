@@ -0,0 +1,50 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <sys/types.h> // ssize_t
+
+#pragma GCC visibility push(hidden)
+
+struct fda; // reada.h
+struct lz4reader;
+
+// Decompress the LZ4 frame format (as produced by lz4(1)), reading the
+// compressed data through the readahead.  Returns 1 on success, 0 on EOF
+// (no data), -1 on error.
+int lz4reader_open(struct lz4reader **zp, struct fda *fda, const char *err[2])
+		   __attribute__((nonnull));
+
+// Start decoding the next concatenated frame, which must follow right after
+// the end of the previous frame.  Returns 1 on success, 0 on EOF, -1 on error.
+int lz4reader_reopen(struct lz4reader *z, struct fda *fda, const char *err[2])
+		     __attribute__((nonnull));
+
+void lz4reader_free(struct lz4reader *z);
+
+// Returns the number of bytes decompressed, which is less than size only
+// at the end of the frame, -1 on error.
+ssize_t lz4reader_read(struct lz4reader *z, void *buf, size_t size, const char *err[2])
+		       __attribute__((nonnull));
+
+// The uncompressed size, from the frame header, or -1 if unknown.
+int64_t lz4reader_contentSize(struct lz4reader *z) __attribute__((nonnull));
+
+#pragma GCC visibility pop
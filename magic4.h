@@ -4,6 +4,7 @@ enum magic4 {
     MAGIC4_ZPKGLIST,
     MAGIC4_ZSTD,
     MAGIC4_XZ,
+    MAGIC4_LZ4,
 };
 
 // Unlike bswap, yields constant expr for a constant arg.
@@ -28,8 +29,14 @@ enum magic4 {
 #define MAGIC4_W_ZPKGLIST       MAGIC4LE(0x184d2a55)
 #define MAGIC4_W_ZPKGLIST_DICT  MAGIC4LE(0x184d2a56)
 #define MAGIC4_W_ZPKGLIST_DATA  MAGIC4LE(0x184d2a57)
+#define MAGIC4_W_ZPKGLIST_INDEX MAGIC4LE(0x184d2a58)
+#define MAGIC4_W_ZPKGLIST_NAMES MAGIC4LE(0x184d2a59)
+#define MAGIC4_W_ZPKGLIST_ZDICT MAGIC4LE(0x184d2a5a)
+#define MAGIC4_W_ZPKGLIST_ZDATA MAGIC4LE(0x184d2a5b)
 #define MAGIC4_W_ZSTD           MAGIC4LE(0xfd2fb528)
+#define MAGIC4_W_ZSTD_SEEKTABLE MAGIC4LE(0x184d2a5e)
 #define MAGIC4_W_XZ             MAGIC4BE(0xfd377a58)
+#define MAGIC4_W_LZ4            MAGIC4LE(0x184d2204)
 
 static inline
 enum magic4 magic4(unsigned w)
@@ -39,6 +46,7 @@ enum magic4 magic4(unsigned w)
     case MAGIC4_W_ZPKGLIST:  return MAGIC4_ZPKGLIST;
     case MAGIC4_W_ZSTD:      return MAGIC4_ZSTD;
     case MAGIC4_W_XZ:        return MAGIC4_XZ;
+    case MAGIC4_W_LZ4:       return MAGIC4_LZ4;
     }
     return MAGIC4_UNKNOWN;
 }
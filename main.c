@@ -19,28 +19,48 @@
 // SOFTWARE.
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
 #include <rpm/rpmlib.h>
 #include "zpkglist.h"
 #include "error.h"
 #include "xwrite.h"
 #include "header.h"
+#include "qf.h"
 
 #define PROG "zpkglist"
 #define warn(fmt, args...) fprintf(stderr, "%s: " fmt "\n", PROG, ##args)
 #define die(fmt, args...) warn(fmt, ##args), exit(128) // like git
 
+// Sane limits for -T and --split=K (each shard takes a descriptor).
+#define MAX_THREADS 1024
+#define MAX_SPLIT 1024
+
 enum {
     OPT_HELP = 256,
     OPT_QF,
     OPT_PRINTSIZE,
     OPT_MALLOC,
     OPT_VIEW,
+    OPT_APPEND,
+    OPT_MERGE,
+    OPT_SPLIT,
+    OPT_LEVEL,
+    OPT_FAST,
+    OPT_ZSTD,
+    OPT_VALIDATE,
+    OPT_TAGS,
+    OPT_INDEX,
+    OPT_VMSPLICE,
 };
 
 static const struct option longopts[] = {
@@ -50,10 +70,88 @@ static const struct option longopts[] = {
     { "uncompress", no_argument, NULL, 'd' },
     { "malloc", no_argument, NULL, OPT_MALLOC },
     { "view", no_argument, NULL, OPT_VIEW },
+    { "threads", required_argument, NULL, 'T' },
+    { "append", required_argument, NULL, OPT_APPEND },
+    { "merge", no_argument, NULL, OPT_MERGE },
+    { "split", required_argument, NULL, OPT_SPLIT },
+    { "level", required_argument, NULL, OPT_LEVEL },
+    { "fast", required_argument, NULL, OPT_FAST },
+    { "zstd", no_argument, NULL, OPT_ZSTD },
+    { "validate", no_argument, NULL, OPT_VALIDATE },
+    { "tags", required_argument, NULL, OPT_TAGS },
+    { "index", no_argument, NULL, OPT_INDEX },
+    { "vmsplice", no_argument, NULL, OPT_VMSPLICE },
     { "help", no_argument, NULL, OPT_HELP },
     { NULL },
 };
 
+// Parse a numeric option's argument, which must be within [min, max].
+static int parseNum(const char *opt, const char *arg, int min, int max)
+{
+    char *end;
+    errno = 0;
+    long n = strtol(arg, &end, 10);
+    if (errno || end == arg || *end || n < min || n > max)
+	die("invalid %s value: %s", opt, arg);
+    return n;
+}
+
+// Parse the comma-separated list of tag names or numbers for --tags.
+static size_t parseTags(const char *list, int **tagsp)
+{
+    size_t n = 1;
+    for (const char *s = list; *s; s++)
+	n += *s == ',';
+    int *tags = malloc(n * sizeof *tags);
+    if (!tags)
+	die("malloc: %m");
+    n = 0;
+    char copy[strlen(list) + 1];
+    char *save, *name = strtok_r(strcpy(copy, list), ",", &save);
+    for (; name; name = strtok_r(NULL, ",", &save)) {
+	char *end;
+	long tag = strtol(name, &end, 10);
+	if (*end || end == name) {
+	    const char *tagname = name;
+	    if (strncasecmp(tagname, "RPMTAG_", 7) == 0)
+		tagname += 7;
+	    tag = rpmTagGetValue(tagname);
+	}
+	if (tag < 0 || tag > INT32_MAX)
+	    die("--tags: unknown tag %s", name);
+	tags[n++] = tag;
+    }
+    if (n == 0)
+	die("--tags: empty list");
+    *tagsp = tags;
+    return n;
+}
+
+// With --tags in compression mode, the input is projected in a separate
+// thread, which feeds the compressor through a pipe.
+struct projectArg {
+    struct zpkglistProjection *p;
+    int fd;
+    int64_t ret;
+    const char *func;
+    const char *err[2];
+};
+
+static void *projectThread(void *arg)
+{
+    struct projectArg *a = arg;
+    struct zpkglistReader *z;
+    a->func = "zpkglistFdopen";
+    a->ret = zpkglistFdopen(&z, 0, a->err);
+    if (a->ret > 0) {
+	a->func = "zpkglistProjectFd";
+	a->ret = zpkglistProjectFd(z, a->p, a->fd, a->err);
+	zpkglistFree(z);
+    }
+    close(a->fd);
+    return NULL;
+}
+
 int main(int argc, char **argv)
 {
     int c;
@@ -61,8 +159,19 @@ int main(int argc, char **argv)
     bool decode = false;
     bool nextView = false, nextMalloc = false;
     bool printsize = false;
+    int nthreads = 1;
     const char *qf = NULL;
-    while ((c = getopt_long(argc, argv, "d", longopts, NULL)) != -1) {
+    const char *append = NULL;
+    bool merge = false;
+    int split = 0;
+    int level = 0, accel = 0;
+    bool zstd = false;
+    bool index = false;
+    bool validate = false;
+    bool vmsplice = false;
+    int *tags = NULL;
+    size_t ntags = 0;
+    while ((c = getopt_long(argc, argv, "dT:", longopts, NULL)) != -1) {
 	switch (c) {
 	case 0:
 	    break;
@@ -81,35 +190,159 @@ int main(int argc, char **argv)
 	case OPT_PRINTSIZE:
 	    printsize = true;
 	    break;
+	case 'T':
+	    nthreads = parseNum("-T", optarg, 0, MAX_THREADS);
+	    break;
+	case OPT_APPEND:
+	    append = optarg;
+	    break;
+	case OPT_MERGE:
+	    merge = true;
+	    break;
+	case OPT_LEVEL:
+	    level = parseNum("--level", optarg, 0, INT_MAX);
+	    break;
+	case OPT_FAST:
+	    accel = parseNum("--fast", optarg, 0, INT_MAX);
+	    break;
+	case OPT_ZSTD:
+	    zstd = true;
+	    break;
+	case OPT_INDEX:
+	    index = true;
+	    break;
+	case OPT_VALIDATE:
+	    validate = true;
+	    break;
+	case OPT_VMSPLICE:
+	    vmsplice = true;
+	    break;
+	case OPT_TAGS:
+	    free(tags);
+	    ntags = parseTags(optarg, &tags);
+	    break;
+	case OPT_SPLIT:
+	    split = parseNum("--split=K", optarg, 1, MAX_SPLIT);
+	    break;
 	default:
 	    usage = 1;
 	}
     }
-    if (argc > optind && !usage) {
+    if (argc > optind + !!split && !merge && !usage) {
 	warn("too many arguments");
 	usage = 1;
     }
-    if (isatty(0) && !usage) {
+    if (argc == optind && split && !usage) {
+	warn("--split=K requires the PREFIX argument");
+	usage = 1;
+    }
+    if (isatty(0) && !merge && !usage) {
 	warn("%s data cannot be read from a terminal",
 	    decode || qf || printsize ? "binary" : "compressed");
 	usage = 1;
     }
     if (usage) {
-	fprintf(stderr, "Usage: " PROG "[-d] [--qf=FMT] <pkglist\n");
+	fprintf(stderr, "Usage: " PROG " [-d] [-T NUM] [--zstd] [--level=NUM|--fast=NUM] [--tags=TAG,...]\n"
+			"       " PROG "      [--index] [--vmsplice] [--qf=FMT] [--append=FILE] <pkglist\n"
+			"       " PROG " --merge FILE... >pkglist\n"
+			"       " PROG " --split=K PREFIX <pkglist\n");
 	return 2;
     }
-    if (!qf && !printsize && isatty(1))
+    if (append && (decode || qf || printsize))
+	die("--append=FILE only works in compression mode");
+    if (merge && (decode || qf || printsize || append))
+	die("--merge is a mode of its own");
+    if (split && (decode || qf || printsize || append || merge))
+	die("--split=K is a mode of its own");
+    if (!append && !split && !qf && !printsize && isatty(1))
 	die("%s data cannot be written to a terminal",
 	    decode ? "binary" : "compressed");
     if (qf && printsize)
 	die("--qf=FMT and --print-content-size are mutually exclusive");
+    if (tags && (merge || split || qf || printsize || nextView || nextMalloc))
+	die("--tags only works in compression mode and with -d");
     posix_fadvise(0, 0, 0, POSIX_FADV_SEQUENTIAL);
     const char *func;
     const char *err[2];
     ssize_t ret;
-    if (!decode && !qf && !printsize) {
-	func = "zpkglistCompress";
-	ret = zpkglistCompress(0, 1, NULL, NULL, err);
+    struct zpkglistProjection *proj = NULL;
+    if (tags) {
+	func = "zpkglistProjectionNew";
+	proj = zpkglistProjectionNew(tags, ntags, err);
+	if (!proj)
+	    die("%s: %s", err[0], err[1]);
+    }
+    // The compressor reads the projection from a pipe.
+    int infd = 0;
+    pthread_t thread;
+    struct projectArg pa = { proj };
+    if (proj && !decode) {
+	int pfd[2];
+	if (pipe2(pfd, O_CLOEXEC) < 0)
+	    die("pipe2: %m");
+	// Should the compressor fail, the thread gets EPIPE.
+	signal(SIGPIPE, SIG_IGN);
+	infd = pfd[0], pa.fd = pfd[1];
+	int rc = pthread_create(&thread, NULL, projectThread, &pa);
+	if (rc)
+	    die("pthread_create: %s", strerror(rc));
+    }
+    if (merge) {
+	int n = argc - optind;
+	int fds[n + 1];
+	for (int i = 0; i < n; i++) {
+	    fds[i] = open(argv[optind+i], O_RDONLY | O_CLOEXEC);
+	    if (fds[i] < 0)
+		die("%s: %m", argv[optind+i]);
+	}
+	func = "zpkglistMerge";
+	ret = zpkglistMerge(1, fds, n, err);
+	if (ret == 0)
+	    warn("empty input (valid output still written)");
+	for (int i = 0; i < n; i++)
+	    close(fds[i]);
+    }
+    else if (split) {
+	// The shards are named PREFIX.0, PREFIX.1, etc.
+	const char *prefix = argv[optind];
+	int fds[split];
+	for (int i = 0; i < split; i++) {
+	    char fname[strlen(prefix) + 16];
+	    snprintf(fname, sizeof fname, "%s.%d", prefix, i);
+	    fds[i] = open(fname, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	    if (fds[i] < 0)
+		die("%s: %m", fname);
+	}
+	func = "zpkglistSplit";
+	ret = zpkglistSplit(0, fds, split, err);
+	if (ret == 0)
+	    warn("empty input (valid output still written)");
+	for (int i = 0; i < split; i++)
+	    if (close(fds[i]) < 0 && ret >= 0)
+		die("%s.%d: %m", prefix, i);
+    }
+    else if (append) {
+	int fd = open(append, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+	    die("%s: %m", append);
+	struct zpkglistCompressOptions opt = {
+	    .nthreads = nthreads, .level = level, .accel = accel,
+	    .zstd = zstd, .append = true, .index = index,
+	};
+	func = "zpkglistCompress2";
+	ret = zpkglistCompress2(infd, fd, NULL, NULL, &opt, err);
+	if (ret == 0)
+	    warn("empty input (%s left intact)", append);
+	if (ret >= 0 && close(fd) < 0)
+	    die("%s: %m", append);
+    }
+    else if (!decode && !qf && !printsize) {
+	struct zpkglistCompressOptions opt = {
+	    .nthreads = nthreads, .level = level, .accel = accel, .zstd = zstd,
+	    .index = index,
+	};
+	func = "zpkglistCompress2";
+	ret = zpkglistCompress2(infd, 1, NULL, NULL, &opt, err);
 	if (ret == 0)
 	    warn("empty input (valid output still written)");
     }
@@ -120,10 +353,30 @@ int main(int argc, char **argv)
 	if (ret == 0 && printsize)
 	    puts("0");
 	if (ret > 0) {
+	    // With -T, multi-block xz input is decoded in parallel.
+	    zpkglistThreads(z, nthreads);
+	    // Headers are checked with --view, --malloc and --qf.
+	    zpkglistValidate(z, validate);
+	    // With -d, only if the reader of the pipe copies the data.
+	    zpkglistVmsplice(z, vmsplice);
 	    if (qf) {
+		// Most formats are handled natively, without loading
+		// the headers; librpm only steps in when it must.
+		struct qf *nq = qfCompile(qf);
 		struct HeaderBlob *blob;
-		func = "zpkglistNextMalloc";
-		while ((ret = zpkglistNextMalloc(z, &blob, NULL, err)) > 0) {
+		func = "zpkglistNextView";
+		while ((ret = zpkglistNextView(z, &blob, NULL, err)) > 0) {
+		    size_t len;
+		    const char *s = nq ? qfFormat(nq, blob, ret, &len) : NULL;
+		    if (s) {
+			fwrite(s, 1, len, stdout);
+			continue;
+		    }
+		    // The header takes ownership of the blob.
+		    void *copy = malloc(ret);
+		    if (!copy)
+			die("malloc: %m");
+		    blob = memcpy(copy, blob, ret);
 		    Header h = headerImport(blob, ret, 0);
 		    if (h == NULL) {
 			func = err[0] = "headerImport",
@@ -131,16 +384,17 @@ int main(int argc, char **argv)
 			ret = -1;
 			break;
 		    }
-		    char *s = headerFormat(h, qf, &err[1]);
-		    if (!s) {
+		    char *hs = headerFormat(h, qf, &err[1]);
+		    if (!hs) {
 			func = err[0] = "headerFormat";
 			ret = -1;
 			break;
 		    }
-		    fputs(s, stdout);
-		    free(s);
+		    fputs(hs, stdout);
+		    free(hs);
 		    headerFree(h);
 		}
+		qfFree(nq);
 	    }
 	    else if (printsize) {
 		int64_t contentSize = zpkglistContentSize(z);
@@ -196,20 +450,29 @@ int main(int argc, char **argv)
 			break;
 		    }
 	    }
+	    else if (proj) {
+		func = "zpkglistProjectFd";
+		ret = zpkglistProjectFd(z, proj, 1, err) < 0 ? -1 : 0;
+	    }
 	    else {
-		void *buf;
-		func = "zpkglistBulk";
-		while ((ret = zpkglistBulk(z, &buf, err)) > 0)
-		    if (!xwrite(1, buf, ret)) {
-			func = "main";
-			ERRNO("write");
-			ret = -1;
-			break;
-		    }
+		func = "zpkglistDecompressFd";
+		ret = zpkglistDecompressFd(z, 1, err) < 0 ? -1 : 0;
 	    }
 	    zpkglistClose(z);
 	}
     }
+    if (proj && !decode) {
+	close(infd);
+	pthread_join(thread, NULL);
+	// Unless the compressor failed first, a projection error means
+	// that the compressor has seen a truncated input.
+	if (pa.ret < 0 && ret >= 0) {
+	    func = pa.func, err[0] = pa.err[0], err[1] = pa.err[1];
+	    ret = -1;
+	}
+    }
+    zpkglistProjectionFree(proj);
+    free(tags);
     if (ret < 0) {
 	if (strcmp(func, err[0]) == 0)
 	    die("%s: %s", err[0], err[1]);
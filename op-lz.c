@@ -1,12 +1,79 @@
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <endian.h>
+#include <sys/stat.h>
 
 #include "zstdreader.h"
-#include "xzreader.h"
+#include "xzmtreader.h"
+#include "lz4reader.h"
 
 #include "error.h"
 #include "header.h"
 #include "reader.h"
+#include "magic4.h"
+
+// The readState of op-lz.c streams, allocated on demand (zstd streams
+// get it on open).
+struct lzState {
+    // NextView decodes into the window and returns pointers into it.
+    // Only a header which straddles the end of the window is moved
+    // to the beginning.  NextMalloc and Bulk consume the window first.
+    char *wbuf, *wcur, *wend;
+    size_t wsize;
+    // The zstd seekable format: a skippable frame at the end of the stream
+    // lists the compressed and uncompressed sizes of the zstd frames, which
+    // makes it possible to start decoding at any frame.  A header's position
+    // is then the frame number in the upper 32 bits, and the offset within
+    // the uncompressed frame in the lower bits.  Without the table (e.g. when
+    // reading from a pipe), positions are still not supported.
+    //
+    // The stream's first frame, relative to where the reading started.
+    int64_t start;
+    // The uncompressed position, counted by opRead (zstd only).
+    int64_t upos;
+    // The seek table has been read through, which ends the stream.
+    bool eos;
+    size_t nframes;
+    // The compressed and uncompressed offsets of the frames,
+    // plus the end of the last frame.
+    struct { int64_t coff, uoff; } frames[];
+};
+
+static struct lzState *lz_state(struct zpkglistReader *z)
+{
+    if (!z->readState)
+	z->readState = calloc(1, sizeof(struct lzState));
+    return z->readState;
+}
+
+// Called by opFree; the state itself is freed by the caller.
+static void lz_freeState(struct zpkglistReader *z)
+{
+    struct lzState *s = z->readState;
+    if (s)
+	free(s->wbuf), s->wbuf = s->wcur = s->wend = NULL, s->wsize = 0;
+}
+
+// Read the uncompressed data, the window first.
+static ssize_t lz_read(struct zpkglistReader *z, void *buf, size_t size, const char *err[2])
+{
+    struct lzState *s = z->readState;
+    size_t n = 0;
+    if (s && s->wcur != s->wend) {
+	n = s->wend - s->wcur;
+	if (n > size)
+	    n = size;
+	memcpy(buf, s->wcur, n);
+	s->wcur += n;
+	if (n == size)
+	    return n;
+    }
+    ssize_t ret = z->ops->opRead(z, (char *) buf + n, size - n, err);
+    if (ret < 0)
+	return -1;
+    return n + ret;
+}
 
 static ssize_t lz_opBulk(struct zpkglistReader *z, void **bufp, const char *err[2])
 {
@@ -24,7 +91,7 @@ static ssize_t lz_opBulk(struct zpkglistReader *z, void **bufp, const char *err[
     // Check against header reading.
     assert(!z->hasLead);
 
-    ssize_t n = z->ops->opRead(z, z->buf, bulkSize, err);
+    ssize_t n = lz_read(z, z->buf, bulkSize, err);
     if (n > 0)
 	*bufp = z->buf;
     return n;
@@ -59,10 +126,174 @@ void *generic_opHdrBuf(struct zpkglistReader *z, size_t size)
     return z->buf;
 }
 
+#define ZSTD_SEEKABLE_MAGIC 0x8f92eab1
+
+// Read at the position, relative to where the reading started,
+// without disturbing the readahead.
+static ssize_t lz_pread(struct zpkglistReader *z, off_t base, void *buf, size_t size, off_t pos)
+{
+    if (z->mem) {
+	if (pos >= z->memSize)
+	    return 0;
+	if (size > z->memSize - pos)
+	    size = z->memSize - pos;
+	memcpy(buf, z->mem + pos, size);
+	return size;
+    }
+    return pread(z->fda.fd, buf, size, base + pos);
+}
+
+// Load the seek table, which must belong to the stream that starts at
+// the current position and goes up to the end of the file.  Returns 1
+// with the table loaded, 0 if there is no table, -1 on error.
+static int lz_loadSeekTable(struct zpkglistReader *z, struct lzState **sp,
+			    const char *err[2])
+{
+    int64_t start = tella(&z->fda);
+    off_t base = 0, end;
+    if (z->mem)
+	end = z->memSize;
+    else {
+	// Reading with a callback, see zpkglistReadopen.
+	if (z->fda.fd < 0)
+	    return 0;
+	struct stat st;
+	if (fstat(z->fda.fd, &st) < 0)
+	    return ERRNO("fstat"), -1;
+	if (!S_ISREG(st.st_mode))
+	    return 0;
+	base = lseek(z->fda.fd, 0, SEEK_CUR);
+	if (base < 0)
+	    return 0;
+	base -= z->fda.fpos;
+	end = st.st_size - base;
+    }
+
+    // The footer: the number of frames, the descriptor, the magic.
+    unsigned char foot[9];
+    if (end - start < 8 + 9)
+	return 0;
+    ssize_t ret = lz_pread(z, base, foot, 9, end - 9);
+    if (ret < 0)
+	return ERRNO("pread"), -1;
+    if (ret != 9)
+	return ERRSTR("unexpected EOF"), -1;
+    unsigned nframes, magic;
+    memcpy(&nframes, foot, 4), nframes = le32toh(nframes);
+    memcpy(&magic, foot + 5, 4), magic = le32toh(magic);
+    // The reserved bits must be zero.
+    if (magic != ZSTD_SEEKABLE_MAGIC || (foot[4] & 0x7f))
+	return 0;
+    // With the checksum flag, entries have a third field.
+    size_t esize = foot[4] & 0x80 ? 12 : 8;
+    if (nframes > (end - start - 8 - 9) / esize)
+	return 0;
+    size_t size = nframes * esize + 9;
+    off_t tpos = end - 8 - (off_t) size;
+
+    unsigned *buf = malloc(8 + size);
+    if (!buf)
+	return ERRNO("malloc"), -1;
+    ret = lz_pread(z, base, buf, 8 + size, tpos);
+    if (ret < 0)
+	return free(buf), ERRNO("pread"), -1;
+    if (ret != 8 + size)
+	return free(buf), ERRSTR("unexpected EOF"), -1;
+    if (buf[0] != MAGIC4_W_ZSTD_SEEKTABLE || le32toh(buf[1]) != size)
+	return free(buf), 0;
+
+    struct lzState *s = malloc(sizeof *s + (nframes + 1) * sizeof s->frames[0]);
+    if (!s)
+	return free(buf), ERRNO("malloc"), -1;
+    memset(s, 0, sizeof *s);
+    int64_t coff = 0, uoff = 0;
+    for (size_t i = 0; i < nframes; i++) {
+	unsigned e[2];
+	memcpy(e, (char *) buf + 8 + i * esize, 8);
+	s->frames[i].coff = coff, coff += le32toh(e[0]);
+	s->frames[i].uoff = uoff, uoff += le32toh(e[1]);
+    }
+    s->frames[nframes].coff = coff;
+    s->frames[nframes].uoff = uoff;
+    free(buf);
+    // If the frames do not add up, the table belongs to another stream.
+    if (coff != tpos - start)
+	return free(s), 0;
+    s->start = start;
+    s->nframes = nframes;
+    *sp = s;
+    return 1;
+}
+
+// Called by opOpen before the underlying reader consumes any input.
+static bool lz_seekOpen(struct zpkglistReader *z, const char *err[2])
+{
+    struct lzState *s = NULL;
+    int rc = lz_loadSeekTable(z, &s, err);
+    if (rc < 0)
+	return false;
+    if (rc == 0) {
+	s = calloc(1, sizeof *s);
+	if (!s)
+	    return ERRNO("malloc"), false;
+    }
+    z->readState = s;
+    return true;
+}
+
+// Skip the seek table frame which follows the last zstd frame.
+static bool lz_skipSeekTable(struct zpkglistReader *z, const char *err[2])
+{
+    unsigned hdr[2];
+    ssize_t ret = reada(&z->fda, hdr, 8);
+    if (ret < 0)
+	return ERRNO("read"), false;
+    if (ret != 8)
+	return ERRSTR("unexpected EOF"), false;
+    size_t size = le32toh(hdr[1]);
+    while (size) {
+	if (z->fda.cur == z->fda.end) {
+	    ret = filla(&z->fda, 1);
+	    if (ret < 0)
+		return ERRNO("read"), false;
+	    if (ret == 0)
+		return ERRSTR("unexpected EOF"), false;
+	}
+	size_t n = z->fda.end - z->fda.cur;
+	if (n > size)
+	    n = size;
+	z->fda.cur += n, size -= n;
+    }
+    struct lzState *s = z->readState;
+    s->eos = true;
+    return true;
+}
+
+// The position of the header which starts at the uncompressed offset.
+static int64_t lz_seekPos(struct lzState *s, int64_t uoff)
+{
+    if (!s || !s->nframes || uoff >= s->frames[s->nframes].uoff)
+	return -1;
+    // The last frame which starts at or before the offset;
+    // empty frames are thus skipped.
+    size_t lo = 0, hi = s->nframes;
+    while (hi - lo > 1) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (s->frames[mid].uoff <= uoff)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    return ((int64_t) lo << 32) | (uoff - s->frames[lo].uoff);
+}
+
 static ssize_t lz_opNextMalloc(struct zpkglistReader *z, int64_t *posp, const char *err[2])
 {
+    // The header starts with the lead, which may have been read already.
+    struct lzState *s = z->readState;
+    int64_t uoff = s ? s->upos - (s->wend - s->wcur) - (z->hasLead ? 16 : 0) : -1;
     if (!z->hasLead) {
-	ssize_t ret = z->ops->opRead(z, z->lead, 16, err);
+	ssize_t ret = lz_read(z, z->lead, 16, err);
 	if (ret <= 0)
 	    return ret;
 	if (ret < 16)
@@ -81,7 +312,7 @@ static ssize_t lz_opNextMalloc(struct zpkglistReader *z, int64_t *posp, const ch
 
     memcpy(buf, z->lead + 2, 8);
 
-    ssize_t ret = z->ops->opRead(z, buf + 8, dataSize + 16, err);
+    ssize_t ret = lz_read(z, buf + 8, dataSize + 16, err);
     if (ret == dataSize + 16) {
 	memcpy(z->lead, buf + 8 + dataSize, 16);
 	if (!headerCheckMagic(z->lead))
@@ -95,30 +326,123 @@ static ssize_t lz_opNextMalloc(struct zpkglistReader *z, int64_t *posp, const ch
     else
 	return ERRSTR("unexpected EOF"), -1;
 
-    // File position not supported.  Cannot get back, at least.
+    // File position not supported, unless there is a seek table.
     if (posp)
-	*posp = -1;
+	*posp = lz_seekPos(s, uoff);
     return 8 + dataSize;
 }
 
+// The window is big enough for a few zstd blocks.
+#define LZ_WINDOW (512 << 10)
+
+// Make sure the window has at least need bytes, unless at the end of the
+// stream.  Returns the number of bytes available, -1 on error.
+static ssize_t lz_fillWindow(struct zpkglistReader *z, struct lzState *s,
+			     size_t need, const char *err[2])
+{
+    size_t avail = s->wend - s->wcur;
+    if (avail >= need)
+	return avail;
+    // Move the partial header to the beginning of the window.
+    if (s->wcur != s->wbuf) {
+	memmove(s->wbuf, s->wcur, avail);
+	s->wcur = s->wbuf;
+	s->wend = s->wbuf + avail;
+    }
+    // A big header (or the first call), grow the window.
+    if (need > s->wsize) {
+	size_t wsize = s->wsize ? s->wsize : LZ_WINDOW;
+	while (wsize < need)
+	    wsize *= 2;
+	char *wbuf = realloc(s->wbuf, wsize);
+	if (!wbuf)
+	    return ERRNO("realloc"), -1;
+	s->wbuf = s->wcur = wbuf;
+	s->wend = wbuf + avail;
+	s->wsize = wsize;
+    }
+    // Fill up the window, a short read means the end of the stream.
+    ssize_t n = z->ops->opRead(z, s->wend, s->wsize - avail, err);
+    if (n < 0)
+	return -1;
+    s->wend += n;
+    return avail + n;
+}
+
 static ssize_t lz_opNextView(struct zpkglistReader *z, void **blobp, int64_t *posp, const char *err[2])
 {
-    ssize_t ret = lz_opNextMalloc(z, posp, err);
-    if (ret > 0)
-	*blobp = z->buf;
-    return ret;
+    // After NextMalloc, the next lead has been read already.
+    if (z->hasLead) {
+	ssize_t ret = lz_opNextMalloc(z, posp, err);
+	if (ret > 0)
+	    *blobp = z->buf;
+	return ret;
+    }
+    struct lzState *s = lz_state(z);
+    if (!s)
+	return ERRNO("malloc"), -1;
+    ssize_t avail = lz_fillWindow(z, s, 16, err);
+    if (avail <= 0)
+	return avail;
+    if (avail < 16)
+	return ERRSTR("unexpected EOF"), -1;
+    unsigned lead[4];
+    memcpy(lead, s->wcur, 16);
+    if (!headerCheckMagic(lead))
+	return ERRSTR("bad header magic"), -1;
+    ssize_t dataSize = headerDataSize(lead);
+    if (dataSize < 0)
+	return ERRSTR("bad header size"), -1;
+
+    // The blob is followed by the next lead, as with NextMalloc.
+    size_t size = 16 + dataSize;
+    avail = lz_fillWindow(z, s, size + 16, err);
+    if (avail < 0)
+	return -1;
+    if (avail == size)
+	// Re-add the trailing 16 bytes, the window has room for them.
+	memcpy(s->wcur + size, lead, 16);
+    else if (avail < size + 16)
+	return ERRSTR("unexpected EOF"), -1;
+
+    char *hdr = s->wcur;
+    s->wcur += size;
+    if (posp)
+	*posp = lz_seekPos(s, s->upos - (s->wend - hdr));
+    *blobp = hdr + 8;
+    return 8 + dataSize;
 }
 
 // Zstd supports contentSize.
 #define CONTENTSIZE
+// Zstd has the seekable format.
+#define SEEKTABLE
 
 #define LZ zstd
 #include "op-lz-template.C"
 #undef LZ
 
+#undef SEEKTABLE
+
 // XZ does not support contentSize.
 #undef CONTENTSIZE
 
+// XZ goes through the wrapper which can also decode with multiple threads.
+#undef LZREADER
+#define LZREADER xzmtreader
+#define THREADS
+
 #define LZ xz
 #include "op-lz-template.C"
 #undef LZ
+
+#undef THREADS
+#undef LZREADER
+#define LZREADER CAT2(LZ, reader)
+
+// LZ4 supports contentSize, if the frame header has it.
+#define CONTENTSIZE
+
+#define LZ lz4
+#include "op-lz-template.C"
+#undef LZ
@@ -204,9 +204,19 @@ static ssize_t OP(NextView)(struct zpkglistReader *z, void **bufp, int64_t *posp
     // Gonna peek at the next header, this will be the result of peeka.
     ssize_t ret;
 
+    // When served from memory, the blob is already there, no matter the size.
+    if (z->mem && z->fda.end == z->mem + z->memSize &&
+	z->fda.end - z->fda.cur >= blobSize) {
+	// Take the memory region, as if by reada().
+	buf = z->fda.cur;
+	z->fda.cur += blobSize;
+	ret = peeka(&z->fda, z->lead, 16);
+	if (ret < 0)
+	    return ERRNO("read"), -1;
+    }
     // Does the blob fit into the fda buffer, along with 16 more bytes
     // of the next blob to peek at?  If it doesn't, resort to malloc.
-    if (blobSize + 16 > maxfilla(&z->fda)) {
+    else if (blobSize + 16 > maxfilla(&z->fda)) {
 	buf = generic_opHdrBuf(z, blobSize);
 	if (!buf)
 	    return ERRNO("malloc"), -1;
@@ -250,6 +260,17 @@ static ssize_t OP(NextView)(struct zpkglistReader *z, void **bufp, int64_t *posp
     return blobSize;
 }
 
+static bool OP(Seek)(struct zpkglistReader *z, int64_t pos, const char *err[2])
+{
+    // The position points to the header's magic, which will be checked
+    // with the next read.
+    if (!seeka(&z->fda, pos, z->mem, z->memSize))
+	return ERRNO("lseek"), false;
+    z->left = 0;
+    z->hasLead = false;
+    return true;
+}
+
 const struct ops OPS = {
     OP(Open),
     OP(Free),
@@ -258,4 +279,5 @@ const struct ops OPS = {
     OP(Bulk),
     OP(NextMalloc),
     OP(NextView),
+    OP(Seek),
 };
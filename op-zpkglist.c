@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include "zpkglist.h"
 #include "reader.h"
 #include "error.h"
 #include "header.h"
@@ -66,7 +67,7 @@ static ssize_t OP(Read)(struct zpkglistReader *z, void *buf, size_t size, const
 static bool OP(Open)(struct zpkglistReader *z, const char *err[2])
 {
     struct zreader *zz;
-    int rc = zreader_open(&zz, &z->fda, err);
+    int rc = zreader_open(&zz, &z->fda, z->mem, z->memSize, err);
     if (rc < 0)
 	return false;
     assert(rc > 0); // starts with the magic
@@ -170,6 +171,161 @@ static ssize_t OP(NextView)(struct zpkglistReader *z, void **blobp, int64_t *pos
     return OP(NextHelper)(z, blobp, posp, false, err);
 }
 
+static bool OP(Seek)(struct zpkglistReader *z, int64_t pos, const char *err[2])
+{
+    if (!z->readState) {
+	z->readState = malloc(sizeof(union readState));
+	if (!z->readState)
+	    return ERRNO("malloc"), false;
+    }
+    memset(z->readState, 0, sizeof(union readState));
+    struct headerReadState *s = &((union readState *) z->readState)->h;
+    // Logical offset => frame offset + header no in the frame.
+    if (!zreader_seek(z->reader, pos >> 2, err))
+	return false;
+    // Decode the frame and skip to the header.
+    for (int ix = pos & 3; ix > 0; ix--) {
+	void *blob;
+	ssize_t ret = OP(NextHelper)(z, &blob, NULL, false, err);
+	if (ret < 0)
+	    return false;
+	// Each skip must leave another header in the frame.
+	if (ret == 0 || s->cur == s->end)
+	    return ERRSTR("bad position"), false;
+    }
+    return true;
+}
+
+static ssize_t OP(FrameIndex)(struct zpkglistReader *z, const struct zpkglistFrame **framesp,
+			      const char *err[2])
+{
+    return zreader_frameIndex(z->reader, framesp, err);
+}
+
+static ssize_t OP(Lookup)(struct zpkglistReader *z, const char *name, const char *arch,
+			  size_t *ip, void **blobp, int64_t *posp, const char *err[2])
+{
+    const struct zreaderName *names;
+    ssize_t nnames = zreader_nameIndex(z->reader, &names, err);
+    if (nnames < 0)
+	return -1;
+    if (nnames == 0)
+	return ERRSTR("no name index"), -1;
+    const struct zpkglistFrame *frames;
+    ssize_t nframes = zreader_frameIndex(z->reader, &frames, err);
+    if (nframes < 0)
+	return -1;
+
+    // Find the first entry with the hash.
+    unsigned hash = headerNameHash(name);
+    size_t lo = 0, hi = nnames;
+    while (lo < hi) {
+	size_t mid = lo + (hi - lo) / 2;
+	if (names[mid].hash < hash)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    // Skip the candidates already tried.
+    for (size_t i = lo + *ip; i < nnames && names[i].hash == hash; i++) {
+	++*ip;
+	if ((names[i].hdr >> 2) >= nframes)
+	    return ERRSTR("bad name index"), -1;
+	const struct zpkglistFrame *f = &frames[names[i].hdr >> 2];
+	if (!OP(Seek)(z, f->pos + (names[i].hdr & 3), err))
+	    return -1;
+	ssize_t ret = OP(NextView)(z, blobp, posp, err);
+	if (ret < 0)
+	    return -1;
+	if (ret == 0)
+	    return ERRSTR("bad name index"), -1;
+	// Hashes may collide, check the name.
+	const char *s = headerGetString(*blobp, 1000); // RPMTAG_NAME
+	if (!s || strcmp(s, name))
+	    continue;
+	if (arch) {
+	    s = headerGetString(*blobp, 1022); // RPMTAG_ARCH
+	    if (!s || strcmp(s, arch))
+		continue;
+	}
+	return ret;
+    }
+    return 0;
+}
+
+static bool OP(Prefetch)(struct zpkglistReader *z, int nframes, const char *err[2])
+{
+    return zreader_prefetch(z->reader, nframes, err);
+}
+
+struct forEachArg {
+    bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+		 void *arg, const char *err[2]);
+    void *arg;
+};
+
+// Split a decoded frame into header blobs, like OP(NextHelper) does.
+// Called from the worker threads.
+static ssize_t OP(ForEachFrame)(void *buf, size_t size, off_t pos, void *arg,
+				const char *err[2])
+{
+    struct forEachArg *fa = arg;
+    char *cur = buf, *end = cur + size;
+    int ix = 0;
+    while (cur != end) {
+	if (ix > 3)
+	    return ERRSTR("too many headers in a frame"), -1;
+	if (end - cur < 8)
+	    return ERRSTR("bad header size"), -1;
+	unsigned lead[4];
+	memcpy(lead + 2, cur, 8);
+	ssize_t dataSize = headerDataSize(lead);
+	if (dataSize < 0 || 8 + dataSize > end - cur)
+	    return ERRSTR("bad data size"), -1;
+	void *blob = cur;
+	cur += 8 + dataSize;
+	if (cur != end) {
+	    // Jumbo frames must contain only one header.
+	    if (size > (128<<10))
+		return ERRSTR("bad jumbo size"), -1;
+	    if (end - cur < 16)
+		return ERRSTR("bad header size"), -1;
+	    if (!headerCheckMagic(cur))
+		return ERRSTR("bad header magic"), -1;
+	    cur += 8;
+	}
+	if (!fa->func(blob, 8 + dataSize, ((int64_t) pos << 2) + ix, fa->arg, err))
+	    return -1;
+	ix++;
+    }
+    return ix;
+}
+
+static ssize_t OP(ForEach)(struct zpkglistReader *z, int nthreads,
+	bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+		     void *arg, const char *err[2]),
+	void *arg, const char *err[2])
+{
+    // Finish the current frame, if a few headers have been read already.
+    ssize_t n = 0;
+    struct headerReadState *s = z->readState ? &((union readState *) z->readState)->h : NULL;
+    while (s && s->cur != s->end) {
+	void *blob;
+	int64_t pos;
+	ssize_t ret = OP(NextView)(z, &blob, &pos, err);
+	if (ret < 0)
+	    return -1;
+	if (!func(blob, ret, pos, arg, err))
+	    return -1;
+	n++;
+    }
+    struct forEachArg fa = { func, arg };
+    ssize_t ret = zreader_forEachFrame(z->reader, nthreads, OP(ForEachFrame), &fa, err);
+    if (ret < 0)
+	return -1;
+    return n + ret;
+}
+
 const struct ops OPS = {
     OP(Open),
     OP(Free),
@@ -178,4 +334,9 @@ const struct ops OPS = {
     OP(Bulk),
     OP(NextMalloc),
     OP(NextView),
+    OP(Seek),
+    OP(FrameIndex),
+    OP(Lookup),
+    OP(Prefetch),
+    OP(ForEach),
 };
@@ -0,0 +1,228 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "zpkglist.h"
+#include "header.h"
+#include "error.h"
+#include "xwrite.h"
+
+struct zpkglistProjection {
+    // The selected tags, sorted.
+    int *tags;
+    size_t ntags;
+    // The output: magic + blob.
+    char *buf;
+    size_t bufSize;
+    // Per-entry scratch: the data size, or 0 if the entry is dropped.
+    unsigned *len;
+    size_t lenSize;
+};
+
+// Region tags (RPMTAG_HEADERSIGNATURES etc.) would point past the data.
+#define isRegionTag(tag) ((unsigned) (tag) - 61 <= 63 - 61)
+#define RPMTAG_HEADERI18NTABLE 100
+
+static int tagCmp(const void *a, const void *b)
+{
+    int x = *(const int *) a;
+    int y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+struct zpkglistProjection *zpkglistProjectionNew(const int *tags, size_t ntags,
+						 const char *err[2])
+{
+    struct zpkglistProjection *p = malloc(sizeof *p);
+    if (!p)
+	return ERRNO("malloc"), NULL;
+    p->tags = malloc((ntags ? ntags : 1) * sizeof *tags);
+    if (!p->tags)
+	return free(p), ERRNO("malloc"), NULL;
+    memcpy(p->tags, tags, ntags * sizeof *tags);
+    qsort(p->tags, ntags, sizeof *tags, tagCmp);
+    p->ntags = ntags;
+    p->buf = NULL;
+    p->bufSize = 0;
+    p->len = NULL;
+    p->lenSize = 0;
+    return p;
+}
+
+void zpkglistProjectionFree(struct zpkglistProjection *p)
+{
+    if (!p)
+	return;
+    free(p->tags);
+    free(p->buf);
+    free(p->len);
+    free(p);
+}
+
+static inline unsigned load32(const char *p)
+{
+    unsigned x;
+    memcpy(&x, p, 4);
+    return ntohl(x);
+}
+
+static inline void store32(char *p, unsigned x)
+{
+    x = htonl(x);
+    memcpy(p, &x, 4);
+}
+
+// Element sizes, indexed by type, for alignment; 0 for invalid types.
+static const unsigned char typeSize[16] = { 0, 1, 1, 2, 4, 8, 1, 1, 1, 1 };
+
+// The size of the entry's data, 0 if the entry is malformed.
+static unsigned dataLen(const char *data, unsigned dl, unsigned type,
+			unsigned off, unsigned cnt)
+{
+    if (type > 15 || !typeSize[type] || off >= dl || cnt - 1 >= dl)
+	return 0;
+    if (type == 6 || type == 8 || type == 9) {
+	const char *p = data + off, *end = data + dl;
+	while (cnt--) {
+	    const char *z = memchr(p, '\0', end - p);
+	    if (!z)
+		return 0;
+	    p = z + 1;
+	}
+	return p - (data + off);
+    }
+    size_t len = (size_t) cnt * typeSize[type];
+    return len > dl - off ? 0 : len;
+}
+
+ssize_t zpkglistProject(struct zpkglistProjection *p,
+	const struct HeaderBlob *blob, size_t blobSize,
+	struct HeaderBlob **outp, const char *err[2])
+{
+    if (blobSize < 8)
+	return ERRSTR("bad header size"), -1;
+    const char *ei = (const char *) blob;
+    unsigned il = load32(ei + 0);
+    unsigned dl = load32(ei + 4);
+    if (il - 1 > headerMaxTags - 1 || dl - 1 > headerMaxData - 1 ||
+	    blobSize != 8 + 16 * il + dl)
+	return ERRSTR("bad header size"), -1;
+    const char *ee = ei + 8;
+    const char *data = ee + 16 * il;
+    if (il > p->lenSize) {
+	unsigned *len = realloc(p->len, il * sizeof *len);
+	if (!len)
+	    return ERRNO("realloc"), -1;
+	p->len = len;
+	p->lenSize = il;
+    }
+    // The first pass selects the entries and lays out the data.
+    // The i18n table goes along with any RPM_I18NSTRING_TYPE entry.
+    bool i18n = false;
+    unsigned nsel = 0;
+    // The data size, with the worst-case padding.
+    size_t need = 0;
+    for (int pass = 0; pass < 2; pass++) {
+	for (unsigned i = 0; i < il; i++) {
+	    const char *e = ee + 16 * i;
+	    int tag = load32(e);
+	    if (pass == 0) {
+		p->len[i] = 0;
+		if (isRegionTag(tag) || !bsearch(&tag, p->tags, p->ntags,
+						 sizeof tag, tagCmp))
+		    continue;
+	    }
+	    else if (tag != RPMTAG_HEADERI18NTABLE || p->len[i])
+		continue;
+	    unsigned type = load32(e + 4);
+	    unsigned len = dataLen(data, dl, type, load32(e + 8), load32(e + 12));
+	    if (!len)
+		return ERRSTR("bad header entries"), -1;
+	    p->len[i] = len;
+	    need += len + typeSize[type] - 1;
+	    if (type == 9)
+		i18n = true;
+	    nsel++;
+	}
+	if (!i18n)
+	    break;
+    }
+    // Nothing to project, a header can't be empty.
+    if (nsel == 0)
+	return 0;
+    size_t size = 8 + 8 + 16 * nsel + need;
+    if (size > p->bufSize) {
+	char *buf = malloc(size);
+	if (!buf)
+	    return ERRNO("malloc"), -1;
+	free(p->buf);
+	p->buf = buf;
+	p->bufSize = size;
+	memcpy(buf, headerMagic, 8);
+    }
+    // The second pass copies the entries, in the original order.
+    char *out = p->buf + 8;
+    char *oee = out + 8;
+    char *odata = oee + 16 * nsel;
+    size_t newdl = 0;
+    for (unsigned i = 0; i < il; i++) {
+	if (!p->len[i])
+	    continue;
+	const char *e = ee + 16 * i;
+	unsigned type = load32(e + 4);
+	unsigned align = typeSize[type];
+	while (newdl & (align - 1))
+	    odata[newdl++] = '\0';
+	memcpy(oee, e, 16);
+	store32(oee + 8, newdl);
+	oee += 16;
+	memcpy(odata + newdl, data + load32(e + 8), p->len[i]);
+	newdl += p->len[i];
+    }
+    // The entries may overlap in the input, but not in the output.
+    if (newdl > headerMaxData)
+	return ERRSTR("projected header too big"), -1;
+    store32(out + 0, nsel);
+    store32(out + 4, newdl);
+    *outp = (struct HeaderBlob *) out;
+    return 8 + 16 * nsel + newdl;
+}
+
+int64_t zpkglistProjectFd(struct zpkglistReader *z, struct zpkglistProjection *p,
+			  int fd, const char *err[2])
+{
+    int64_t total = 0;
+    struct HeaderBlob *blob;
+    ssize_t n;
+    while ((n = zpkglistNextView(z, &blob, NULL, err)) > 0) {
+	n = zpkglistProject(p, blob, n, &blob, err);
+	if (n < 0)
+	    return -1;
+	if (n == 0)
+	    continue;
+	// The magic precedes the blob in the output buffer.
+	if (!xwrite(fd, (char *) blob - 8, 8 + n))
+	    return ERRNO("write"), -1;
+	total++;
+    }
+    return n < 0 ? -1 : total;
+}
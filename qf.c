@@ -0,0 +1,540 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <rpm/rpmlib.h>
+#include "qf.h"
+
+enum { QF_TEXT, QF_TAG, QF_ARRAY };
+
+struct qfToken {
+    int type;
+    // QF_TEXT: the literal text (not NUL-terminated).
+    char *text;
+    size_t len;
+    // QF_TAG: the index into qf->tags, '=' or '#' or 0, and the formatter.
+    size_t slot;
+    char mode;
+    char conv;
+    // QF_TAG: as with printf %-20.10s, precision -1 if not specified.
+    bool left;
+    int width, prec;
+    // QF_ARRAY: the number of tokens which follow and belong to the array.
+    size_t ntok;
+};
+
+// The tag's entry in the header being formatted.
+struct qfEntry {
+    bool found;
+    unsigned type, off, cnt;
+    // The position within a string array, to avoid rescanning.
+    unsigned ix;
+    const char *cur;
+};
+
+struct qf {
+    struct qfToken *tok;
+    size_t ntok;
+    // The last token ends an array, a literal cannot be merged into it.
+    bool arrayEnd;
+    int *tags;
+    struct qfEntry *ent;
+    size_t ntags;
+    // With other locales, i18n strings should be looked up by librpm.
+    bool cLocale;
+    // The output buffer.
+    char *buf;
+    size_t len, size;
+};
+
+static struct qfToken *qfAddToken(struct qf *qf, int type)
+{
+    if ((qf->ntok & (qf->ntok + 1)) == 0) {
+	struct qfToken *tok = realloc(qf->tok, 2 * (qf->ntok + 1) * sizeof *tok);
+	if (!tok)
+	    return NULL;
+	qf->tok = tok;
+    }
+    struct qfToken *t = &qf->tok[qf->ntok++];
+    memset(t, 0, sizeof *t);
+    qf->arrayEnd = false;
+    t->type = type;
+    return t;
+}
+
+static bool qfAddText(struct qf *qf, const char *s, size_t len)
+{
+    // Coalesce with the previous literal, which has been malloc'd.
+    struct qfToken *t = qf->ntok ? &qf->tok[qf->ntok-1] : NULL;
+    if (!t || t->type != QF_TEXT || qf->arrayEnd) {
+	t = qfAddToken(qf, QF_TEXT);
+	if (!t)
+	    return false;
+    }
+    char *text = realloc(t->text, t->len + len);
+    if (!text)
+	return false;
+    memcpy(text + t->len, s, len);
+    t->text = text;
+    t->len += len;
+    return true;
+}
+
+static bool qfAddTag(struct qf *qf, int tag, struct qfToken *t)
+{
+    for (size_t i = 0; i < qf->ntags; i++)
+	if (qf->tags[i] == tag)
+	    return t->slot = i, true;
+    if ((qf->ntags & (qf->ntags + 1)) == 0) {
+	int *tags = realloc(qf->tags, 2 * (qf->ntags + 1) * sizeof *tags);
+	if (!tags)
+	    return false;
+	qf->tags = tags;
+    }
+    t->slot = qf->ntags;
+    qf->tags[qf->ntags++] = tag;
+    return true;
+}
+
+// Parse %{...}, s points after the '%'.
+static const char *qfParseTag(struct qf *qf, const char *s)
+{
+    // The printf flags, width and precision, which librpm applies
+    // with %s to the value formatted as a string.
+    bool left = false;
+    int width = 0, prec = -1;
+    for (; *s && strchr("-+ #0", *s); s++)
+	if (*s == '-')
+	    left = true;
+    for (; *s >= '0' && *s <= '9'; s++)
+	if ((width = 10 * width + *s - '0') > 4096)
+	    return NULL;
+    if (*s == '.')
+	for (prec = 0, s++; *s >= '0' && *s <= '9'; s++)
+	    if ((prec = 10 * prec + *s - '0') > 4096)
+		return NULL;
+    if (*s++ != '{')
+	return NULL;
+    char mode = 0;
+    if (*s == '=' || *s == '#')
+	mode = *s++;
+    size_t n = strspn(s, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_");
+    if (n == 0 || n > 64)
+	return NULL;
+    char name[65];
+    memcpy(name, s, n), name[n] = '\0';
+    s += n;
+    char conv = 0;
+    if (*s == ':') {
+	s++;
+	if (strncmp(s, "hex}", 4) == 0)
+	    conv = 'x', s += 3;
+	else if (strncmp(s, "octal}", 6) == 0)
+	    conv = 'o', s += 5;
+	else
+	    return NULL;
+    }
+    if (*s != '}')
+	return NULL;
+    // The tag table lookup is case-insensitive.
+    const char *tagname = name;
+    if (strncasecmp(tagname, "RPMTAG_", 7) == 0)
+	tagname += 7;
+    int tag = rpmTagGetValue(tagname);
+    if (tag < 0)
+	return NULL;
+    struct qfToken *t = qfAddToken(qf, QF_TAG);
+    if (!t)
+	return NULL;
+    t->left = left;
+    t->width = width;
+    t->prec = prec;
+    t->mode = mode;
+    t->conv = conv;
+    if (!qfAddTag(qf, tag, t))
+	return NULL;
+    return s + 1;
+}
+
+void qfFree(struct qf *qf)
+{
+    if (!qf)
+	return;
+    for (size_t i = 0; i < qf->ntok; i++)
+	free(qf->tok[i].text);
+    free(qf->tok);
+    free(qf->tags);
+    free(qf->ent);
+    free(qf->buf);
+    free(qf);
+}
+
+static bool qfIsCLocale(void)
+{
+    // The same variables as consulted by librpm, in the same order.
+    const char *vars[] = { "LANGUAGE", "LC_ALL", "LC_MESSAGES", "LANG" };
+    for (size_t i = 0; i < sizeof vars / sizeof *vars; i++) {
+	const char *v = getenv(vars[i]);
+	if (v && *v)
+	    return strcmp(v, "C") == 0 || strcmp(v, "POSIX") == 0;
+    }
+    return true;
+}
+
+struct qf *qfCompile(const char *s)
+{
+    struct qf *qf = calloc(1, sizeof *qf);
+    if (!qf)
+	return NULL;
+    // The array token being parsed.
+    size_t arr = SIZE_MAX;
+    while (*s) {
+	char c = *s++;
+	switch (c) {
+	case '\\':
+	    switch (c = *s++) {
+	    case '\0': goto bad;
+	    case 'a': c = '\a'; break;
+	    case 'b': c = '\b'; break;
+	    case 'f': c = '\f'; break;
+	    case 'n': c = '\n'; break;
+	    case 'r': c = '\r'; break;
+	    case 't': c = '\t'; break;
+	    case 'v': c = '\v'; break;
+	    }
+	    if (!qfAddText(qf, &c, 1))
+		goto bad;
+	    break;
+	case '%':
+	    if (*s == '%') {
+		if (!qfAddText(qf, s++, 1))
+		    goto bad;
+		break;
+	    }
+	    // Conditionals are left to librpm.
+	    s = qfParseTag(qf, s);
+	    if (!s)
+		goto bad;
+	    break;
+	case '[':
+	    // Nested arrays are left to librpm.
+	    if (arr != SIZE_MAX || !qfAddToken(qf, QF_ARRAY))
+		goto bad;
+	    arr = qf->ntok - 1;
+	    break;
+	case ']':
+	    if (arr == SIZE_MAX)
+		goto bad;
+	    qf->tok[arr].ntok = qf->ntok - arr - 1;
+	    qf->arrayEnd = true;
+	    arr = SIZE_MAX;
+	    break;
+	case '{': case '}':
+	    goto bad;
+	default:
+	    if (!qfAddText(qf, &c, 1))
+		goto bad;
+	}
+    }
+    if (arr != SIZE_MAX)
+	goto bad;
+    qf->ent = malloc(qf->ntags * sizeof *qf->ent + 1);
+    if (!qf->ent)
+	goto bad;
+    qf->cLocale = qfIsCLocale();
+    return qf;
+bad:
+    qfFree(qf);
+    return NULL;
+}
+
+static bool qfReserve(struct qf *qf, size_t n)
+{
+    if (qf->size - qf->len > n)
+	return true;
+    size_t size = qf->size ? qf->size : 4096;
+    while (size - qf->len <= n)
+	size *= 2;
+    char *buf = realloc(qf->buf, size);
+    if (!buf)
+	return false;
+    qf->buf = buf;
+    qf->size = size;
+    return true;
+}
+
+static bool qfPut(struct qf *qf, const char *s, size_t n)
+{
+    if (!qfReserve(qf, n))
+	return false;
+    memcpy(qf->buf + qf->len, s, n);
+    qf->len += n;
+    return true;
+}
+
+// The value has been appended at start, cut and pad it as per the format.
+static bool qfPad(struct qf *qf, const struct qfToken *t, size_t start)
+{
+    size_t n = qf->len - start;
+    if (t->prec >= 0 && n > t->prec)
+	qf->len = start + (n = t->prec);
+    if (n >= t->width)
+	return true;
+    size_t pad = t->width - n;
+    if (!qfReserve(qf, pad))
+	return false;
+    char *s = qf->buf + start;
+    if (t->left)
+	memset(s + n, ' ', pad);
+    else {
+	memmove(s + pad, s, n);
+	memset(s, ' ', pad);
+    }
+    qf->len += pad;
+    return true;
+}
+
+static bool qfPutValue(struct qf *qf, const struct qfToken *t, const char *s, size_t n)
+{
+    size_t start = qf->len;
+    return qfPut(qf, s, n) && qfPad(qf, t, start);
+}
+
+// The number of elements as seen by librpm.
+static unsigned qfCount(const struct qfEntry *e)
+{
+    switch (e->type) {
+    case RPM_STRING_TYPE:
+    case RPM_I18NSTRING_TYPE:
+    case RPM_BIN_TYPE:
+	return 1;
+    }
+    return e->cnt;
+}
+
+// Format the j-th element of the tag's value.
+static bool qfFormatTag(struct qf *qf, const struct qfToken *t, unsigned j,
+			const char *data, unsigned dl)
+{
+    struct qfEntry *e = &qf->ent[t->slot];
+    if (t->mode == '#') {
+	char num[16];
+	int n = snprintf(num, sizeof num, "%u", qfCount(e));
+	return qfPutValue(qf, t, num, n);
+    }
+    if (t->mode == '=')
+	j = 0;
+    if (j >= qfCount(e))
+	return false;
+    const char *p = data + e->off;
+    size_t left = dl - e->off;
+    uint64_t v;
+    switch (e->type) {
+    case RPM_STRING_TYPE:
+    case RPM_I18NSTRING_TYPE:
+    case RPM_STRING_ARRAY_TYPE: {
+	if (t->conv)
+	    return false;
+	// Resume the scan, the elements are usually accessed in order.
+	if (e->cur && e->ix <= j)
+	    left -= e->cur - p, p = e->cur;
+	else
+	    e->ix = 0;
+	while (1) {
+	    const char *z = memchr(p, '\0', left);
+	    if (!z)
+		return false;
+	    if (e->ix == j) {
+		e->cur = p;
+		return qfPutValue(qf, t, p, z - p);
+	    }
+	    left -= z + 1 - p, p = z + 1;
+	    e->ix++;
+	}
+    }
+    case RPM_BIN_TYPE: {
+	if (t->conv)
+	    return false;
+	static const char hex[] = "0123456789abcdef";
+	if (!qfReserve(qf, 2 * (size_t) e->cnt))
+	    return false;
+	size_t start = qf->len;
+	char *s = qf->buf + start;
+	for (unsigned i = 0; i < e->cnt; i++) {
+	    s[2*i+0] = hex[(unsigned char) p[i] >> 4];
+	    s[2*i+1] = hex[(unsigned char) p[i] & 15];
+	}
+	qf->len += 2 * (size_t) e->cnt;
+	return qfPad(qf, t, start);
+    }
+    case RPM_CHAR_TYPE:
+    case RPM_INT8_TYPE:
+	v = (unsigned char) p[j];
+	break;
+    case RPM_INT16_TYPE: {
+	uint16_t x;
+	memcpy(&x, p + 2 * j, 2);
+	v = ntohs(x);
+	break;
+    }
+    case RPM_INT32_TYPE: {
+	uint32_t x;
+	memcpy(&x, p + 4 * j, 4);
+	v = ntohl(x);
+	break;
+    }
+    case RPM_INT64_TYPE: {
+	uint32_t x[2];
+	memcpy(x, p + 8 * j, 8);
+	v = (uint64_t) ntohl(x[0]) << 32 | ntohl(x[1]);
+	break;
+    }
+    default:
+	return false;
+    }
+    char num[24];
+    int n = snprintf(num, sizeof num, t->conv == 'x' ? "%" PRIx64 :
+		     t->conv == 'o' ? "%" PRIo64 : "%" PRIu64, v);
+    return qfPutValue(qf, t, num, n);
+}
+
+static bool qfFormatTokens(struct qf *qf, const struct qfToken *tok, size_t ntok,
+			   unsigned j, const char *data, unsigned dl)
+{
+    for (size_t i = 0; i < ntok; i++) {
+	const struct qfToken *t = &tok[i];
+	if (t->type == QF_TEXT) {
+	    if (!qfPut(qf, t->text, t->len))
+		return false;
+	    continue;
+	}
+	if (t->type == QF_TAG) {
+	    if (!qfFormatTag(qf, t, j, data, dl))
+		return false;
+	    continue;
+	}
+	// The array is iterated over the tags which are neither '=' nor '#';
+	// librpm complains if their sizes differ.
+	int n = -1;
+	for (size_t k = i + 1; k <= i + t->ntok; k++) {
+	    if (tok[k].type != QF_TAG || tok[k].mode)
+		continue;
+	    int cnt = qfCount(&qf->ent[tok[k].slot]);
+	    if (n >= 0 && cnt != n)
+		return false;
+	    n = cnt;
+	}
+	for (int jj = 0; jj < n; jj++)
+	    if (!qfFormatTokens(qf, t + 1, t->ntok, jj, data, dl))
+		return false;
+	i += t->ntok;
+    }
+    return true;
+}
+
+// The element size of fixed-size types, 0 for strings.
+static int qfTypeSize(unsigned type)
+{
+    switch (type) {
+    case RPM_CHAR_TYPE:
+    case RPM_INT8_TYPE:
+    case RPM_BIN_TYPE:
+	return 1;
+    case RPM_INT16_TYPE:
+	return 2;
+    case RPM_INT32_TYPE:
+	return 4;
+    case RPM_INT64_TYPE:
+	return 8;
+    case RPM_STRING_TYPE:
+    case RPM_STRING_ARRAY_TYPE:
+    case RPM_I18NSTRING_TYPE:
+	return 0;
+    }
+    return -1;
+}
+
+const char *qfFormat(struct qf *qf, const struct HeaderBlob *blob, size_t blobSize,
+		     size_t *lenp)
+{
+    // The blob is not necessarily aligned.
+    const char *ei = (const void *) blob;
+    unsigned il, dl;
+    memcpy(&il, ei + 0, 4), il = ntohl(il);
+    memcpy(&dl, ei + 4, 4), dl = ntohl(dl);
+    if (blobSize < 8 || (blobSize - 8) / 16 < il || blobSize - 8 - 16 * il != dl)
+	return NULL;
+    const char *data = ei + 8 + 16 * il;
+
+    // A single pass over ee[] for all the tags.  On disk, the entries are
+    // ordered by offset rather than by tag, so there's no binary search.
+    for (size_t i = 0; i < qf->ntags; i++)
+	qf->ent[i].found = false;
+    bool i18nTable = false;
+    size_t nfound = 0;
+    for (unsigned i = 0; i < il; i++) {
+	unsigned ee[4];
+	memcpy(ee, ei + 8 + 16 * i, 16);
+	int tag = ntohl(ee[0]);
+	if (tag == RPMTAG_HEADERI18NTABLE)
+	    i18nTable = true;
+	for (size_t k = 0; k < qf->ntags; k++) {
+	    struct qfEntry *e = &qf->ent[k];
+	    if (qf->tags[k] != tag || e->found)
+		continue;
+	    e->found = true;
+	    e->type = ntohl(ee[1]);
+	    e->off = ntohl(ee[2]);
+	    e->cnt = ntohl(ee[3]);
+	    e->cur = NULL;
+	    nfound++;
+	}
+    }
+    // Missing tags are left to librpm, which can also compute them.
+    if (nfound < qf->ntags)
+	return NULL;
+    for (size_t k = 0; k < qf->ntags; k++) {
+	struct qfEntry *e = &qf->ent[k];
+	int size = qfTypeSize(e->type);
+	if (size < 0 || e->cnt == 0 || e->off >= dl)
+	    return NULL;
+	if (size && (uint64_t) size * e->cnt > dl - e->off)
+	    return NULL;
+	if (e->type == RPM_I18NSTRING_TYPE && i18nTable && !qf->cLocale)
+	    return NULL;
+    }
+    qf->len = 0;
+    if (!qfFormatTokens(qf, qf->tok, qf->ntok, 0, data, dl))
+	return NULL;
+    // The output can be empty.
+    if (!qfReserve(qf, 1))
+	return NULL;
+    qf->buf[qf->len] = '\0';
+    *lenp = qf->len;
+    return qf->buf;
+}
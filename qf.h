@@ -0,0 +1,46 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stddef.h>
+
+// A native implementation of the common subset of rpm's query formats,
+// which works on header blobs directly, without loading them with librpm:
+// %{TAG}, with the printf-style width and the :hex and :octal formatters,
+// %{=TAG} and %{#TAG}, [...] iteration, and the backslash escapes.
+
+struct qf;
+struct HeaderBlob;
+
+// Returns NULL if the format is not supported (or not valid), in which case
+// the caller should resort to librpm's headerFormat.
+struct qf *qfCompile(const char *fmt);
+
+// Format the header blob (blobSize as returned by zpkglistNextView).
+// Returns the formatted string, which is valid until the next call, with
+// its length returned via lenp.  Returns NULL if the header cannot be
+// formatted exactly as librpm would do it, e.g. when the tag is missing
+// (librpm may then print "(none)", or compute the value), or when the arrays
+// iterated over are of different sizes.  The caller should fall back to
+// librpm for this header.
+const char *qfFormat(struct qf *qf, const struct HeaderBlob *blob, size_t blobSize,
+		     size_t *lenp);
+
+void qfFree(struct qf *qf);
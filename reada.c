@@ -0,0 +1,96 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include "reada.h"
+
+// Read from the source, until size bytes or EOF.
+static ssize_t readsrc(struct fda *fda, void *buf, size_t size)
+{
+    // Memory-backed, nothing past the readahead.
+    if (fda->fd < 0 && !fda->readfunc)
+	return 0;
+    size_t total = 0;
+    while (size) {
+	ssize_t n = fda->readfunc ? fda->readfunc(buf, size, fda->arg)
+				  : read(fda->fd, buf, size);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    return -1;
+	}
+	if (n == 0)
+	    break;
+	buf = (char *) buf + n;
+	size -= n, total += n;
+    }
+    return total;
+}
+
+ssize_t filla(struct fda *fda, size_t size)
+{
+    if (size > NREADA)
+	size = NREADA;
+    size_t fill = fda->end - fda->cur;
+    if (fill >= size)
+	return size;
+    // Move the leftover to the start of the buffer (it can also come
+    // from the caller's memory) and top the buffer up.
+    if (fill && fda->cur != fda->buf)
+	memmove(fda->buf, fda->cur, fill);
+    fda->cur = fda->buf;
+    fda->end = fda->buf + fill;
+    ssize_t n = readsrc(fda, fda->end, NREADA - fill);
+    if (n < 0)
+	return -1;
+    fda->end += n, fda->fpos += n;
+    fill += n;
+    return fill < size ? fill : size;
+}
+
+ssize_t peeka(struct fda *fda, void *buf, size_t size)
+{
+    ssize_t n = filla(fda, size);
+    if (n > 0)
+	memcpy(buf, fda->cur, n);
+    return n;
+}
+
+ssize_t reada(struct fda *fda, void *buf, size_t size)
+{
+    size_t fill = fda->end - fda->cur;
+    if (fill >= size) {
+	memcpy(buf, fda->cur, size);
+	fda->cur += size;
+	return size;
+    }
+    // Drain the readahead, the rest goes directly into the buffer.
+    if (fill)
+	memcpy(buf, fda->cur, fill);
+    fda->cur = fda->end = fda->buf;
+    ssize_t n = readsrc(fda, (char *) buf + fill, size - fill);
+    if (n < 0)
+	return -1;
+    fda->fpos += n;
+    return fill + n;
+}
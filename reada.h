@@ -0,0 +1,78 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <sys/types.h> // ssize_t, off_t
+
+#pragma GCC visibility push(hidden)
+
+// Readahead: the data is read from the descriptor in big chunks, and then
+// handed out in small pieces.
+struct fda {
+    // The source descriptor.  If fd is -1 and there is no readfunc,
+    // the readahead is backed by memory: the data ends where
+    // the readahead ends.
+    int fd;
+    // The buffer of NREADA bytes, provided by the caller.
+    char *buf;
+    // The readahead, normally points into buf; can also be set up
+    // to point into the caller's memory.
+    char *cur, *end;
+    // The source position, corresponds to the end of the readahead.
+    off_t fpos;
+    // With fd = -1, the data can be read with the callback, which works
+    // like read(2).  Its errno is passed through.
+    ssize_t (*readfunc)(void *buf, size_t size, void *arg);
+    void *arg;
+};
+
+#define NREADA (64 << 10)
+
+// Read exactly size bytes, unless EOF is hit.  Returns the number of
+// bytes read, -1 on error (with errno set).
+ssize_t reada(struct fda *fda, void *buf, size_t size);
+
+// Make sure there are size bytes in the readahead (at most NREADA bytes
+// can be requested).  Returns the number of bytes available, which can
+// be less than size on EOF (0 at the very end), -1 on error.
+ssize_t filla(struct fda *fda, size_t size);
+
+// Like reada, but leave the data in the readahead.
+ssize_t peeka(struct fda *fda, void *buf, size_t size);
+
+// The maximum size that filla can fill.
+static inline size_t maxfilla(struct fda *fda)
+{
+    (void) fda;
+    return NREADA;
+}
+
+// The current logical position.
+static inline off_t tella(struct fda *fda)
+{
+    return fda->fpos - (fda->end - fda->cur);
+}
+
+#pragma GCC visibility pop
@@ -23,12 +23,20 @@
 #include <string.h>
 #include <assert.h>
 #include <unistd.h> // close
+#include <fcntl.h> // F_GETPIPE_SZ
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <endian.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "zpkglist.h"
 #include "reader.h"
 #include "reada.h"
 #include "error.h"
 #include "magic4.h"
+#include "xwrite.h"
+#include "validate.h"
+#include "bswap.h"
 
 static const struct ops *allOps[] = {
     /* The same order as magic4. */
@@ -36,6 +44,7 @@ static const struct ops *allOps[] = {
     &ops_zpkglist,
     &ops_zstd,
     &ops_xz,
+    &ops_lz4,
 };
 
 static int zpkglistBegin(struct fda *fda, const struct ops **opsp, const char *err[2])
@@ -58,55 +67,163 @@ static int zpkglistBegin(struct fda *fda, const struct ops **opsp, const char *e
     return 1;
 }
 
-int zpkglistFdopen(struct zpkglistReader **zp, int fd, const char *err[2])
+static struct zpkglistReader *zpkglistNew(int fd)
 {
     struct zpkglistReader *z = malloc(sizeof *z);
     if (!z)
-	return ERRNO("malloc"), -1;
-
+	return NULL;
     z->fda = (struct fda) { fd, z->fdabuf };
+    z->readState = NULL;
+    z->prefetch = 0;
+    z->threads = 1;
+    z->validate = false;
+    z->vmsplice = false;
+    z->mem = NULL;
+    z->memSize = 0;
+    z->map = NULL;
+    z->mapSize = 0;
+    return z;
+}
+
+// Release the resources other than those of the backend.
+static void zpkglistRelease(struct zpkglistReader *z)
+{
+    if (z->map)
+	munmap(z->map, z->mapSize);
+    free(z);
+}
 
+static int zpkglistStart(struct zpkglistReader **zp, struct zpkglistReader *z,
+			 const char *err[2])
+{
     int rc = zpkglistBegin(&z->fda, &z->ops, err);
     if (rc <= 0)
-	return free(z), rc;
+	return zpkglistRelease(z), rc;
 
     if (!z->ops->opOpen(z, err))
-	return free(z), -1;
+	return zpkglistRelease(z), -1;
 
     z->hasLead = false;
     z->eof = false;
     z->buf = NULL;
     z->bufSize = 0;
+    z->native = NULL;
+    z->nativeSize = 0;
 
     *zp = z;
     return 1;
 }
 
+// Serve the readahead from memory, which corresponds to the position 0.
+// The readahead points into the memory, while fda->buf remains the proper
+// buffer: at the end of the memory, the leftover is moved there, and the
+// rest is read from the descriptor, which must be positioned accordingly
+// (or there is no descriptor, see zpkglistMemopen).
+static void zpkglistSetMem(struct zpkglistReader *z, const char *mem, size_t size)
+{
+    z->mem = mem;
+    z->memSize = size;
+    z->fda.cur = (char *) mem;
+    z->fda.end = (char *) mem + size;
+    z->fda.fpos = size;
+}
+
+// A regular file is mapped into memory, the descriptor being positioned
+// at the end.  Small files are not worth it.
+static void zpkglistMmap(struct zpkglistReader *z)
+{
+    int fd = z->fda.fd;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+	return;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+    if (pos < 0 || st.st_size - pos < NREADA)
+	return;
+    // The offset must be page-aligned.
+    off_t off = pos & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    size_t size = st.st_size - off;
+    void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, off);
+    if (map == MAP_FAILED)
+	return;
+    if (lseek(fd, st.st_size, SEEK_SET) < 0) {
+	munmap(map, size);
+	return;
+    }
+    madvise(map, size, MADV_SEQUENTIAL);
+    z->map = map;
+    z->mapSize = size;
+    zpkglistSetMem(z, (char *) map + (pos - off), st.st_size - pos);
+}
+
+int zpkglistFdopen(struct zpkglistReader **zp, int fd, const char *err[2])
+{
+    struct zpkglistReader *z = zpkglistNew(fd);
+    if (!z)
+	return ERRNO("malloc"), -1;
+    zpkglistMmap(z);
+    return zpkglistStart(zp, z, err);
+}
+
+int zpkglistMemopen(struct zpkglistReader **zp, const void *buf, size_t size,
+		    const char *err[2])
+{
+    // Without the descriptor, the readahead hits EOF at the end of the buffer.
+    struct zpkglistReader *z = zpkglistNew(-1);
+    if (!z)
+	return ERRNO("malloc"), -1;
+    zpkglistSetMem(z, buf, size);
+    return zpkglistStart(zp, z, err);
+}
+
+int zpkglistReadopen(struct zpkglistReader **zp,
+		     ssize_t (*readfunc)(void *buf, size_t size, void *arg),
+		     void *arg, const char *err[2])
+{
+    struct zpkglistReader *z = zpkglistNew(-1);
+    if (!z)
+	return ERRNO("malloc"), -1;
+    z->fda.readfunc = readfunc;
+    z->fda.arg = arg;
+    return zpkglistStart(zp, z, err);
+}
+
 void zpkglistFree(struct zpkglistReader *z)
 {
     if (!z)
 	return;
     z->ops->opFree(z);
+    free(z->readState);
     free(z->buf);
-    free(z);
+    free(z->native);
+    zpkglistRelease(z);
 }
 
 void zpkglistClose(struct zpkglistReader *z)
 {
     if (!z)
 	return;
-    close(z->fda.fd);
+    if (z->fda.fd >= 0)
+	close(z->fda.fd);
     zpkglistFree(z);
 }
 
 static int zpkglistConcat(struct zpkglistReader *z, const char *err[2])
 {
-    z->ops->opFree(z), z->reader = NULL;
-
-    int rc = zpkglistBegin(&z->fda, &z->ops, err);
+    // On EOF, the current stream is kept, so that it can still seek.
+    const struct ops *ops;
+    int rc = zpkglistBegin(&z->fda, &ops, err);
     if (rc <= 0)
 	return rc;
-    return z->ops->opOpen(z, err);
+
+    z->ops->opFree(z), z->reader = NULL;
+    free(z->readState), z->readState = NULL;
+
+    z->ops = ops;
+    if (!z->ops->opOpen(z, err))
+	return -1;
+    if (z->prefetch && z->ops->opPrefetch)
+	return z->ops->opPrefetch(z, z->prefetch, err) ? 1 : -1;
+    return 1;
 }
 
 #define ConcatRead(n, opReadCall)		\
@@ -135,10 +252,103 @@ ssize_t zpkglistBulk(struct zpkglistReader *z, void **bufp, const char *err[2])
     return n;
 }
 
+// Splice the whole buffer into the pipe, waiting if it's non-blocking.
+static bool xvmsplice(int fd, char *buf, size_t size)
+{
+    struct iovec iov = { buf, size };
+    while (iov.iov_len) {
+	ssize_t n = vmsplice(fd, &iov, 1, 0);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    if (errno == EAGAIN) {
+		struct pollfd pfd = { fd, POLLOUT };
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		    return false;
+		continue;
+	    }
+	    return false;
+	}
+	iov.iov_base = (char *) iov.iov_base + n;
+	iov.iov_len -= n;
+    }
+    return true;
+}
+
+// The pipe refers to the spliced pages until the data is read, so a buffer
+// cannot be refilled right away.  There are two buffers, each as big as
+// the pipe, and page-aligned: once the second buffer is spliced in whole,
+// all the pages of the first one must have been consumed.  The data is
+// decoded into the buffers with zpkglistRead, directly where possible.
+static int64_t zpkglistSplice(struct zpkglistReader *z, int fd, size_t bufSize,
+			      const char *err[2])
+{
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    bufSize = (bufSize + pageSize - 1) & ~(pageSize - 1);
+    char *bufs = mmap(NULL, 2 * bufSize, PROT_READ | PROT_WRITE,
+		      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (bufs == MAP_FAILED)
+	return ERRNO("mmap"), -1;
+    int64_t total = 0;
+    for (int k = 0; ; k ^= 1) {
+	char *buf = bufs + k * bufSize;
+	size_t fill = 0;
+	while (fill < bufSize) {
+	    ssize_t n = zpkglistRead(z, buf + fill, bufSize - fill, err);
+	    if (n < 0)
+		return munmap(bufs, 2 * bufSize), -1;
+	    if (n == 0)
+		break;
+	    fill += n;
+	}
+	if (fill && !xvmsplice(fd, buf, fill))
+	    return munmap(bufs, 2 * bufSize), ERRNO("vmsplice"), -1;
+	total += fill;
+	// Short of the buffer size only at EOF.
+	if (fill < bufSize)
+	    break;
+    }
+    // The pipe may still refer to the pages, they are released
+    // once the reader is done with them.
+    munmap(bufs, 2 * bufSize);
+    return total;
+}
+
+int64_t zpkglistDecompressFd(struct zpkglistReader *z, int fd, const char *err[2])
+{
+    if (z->vmsplice) {
+	struct stat st;
+	if (fstat(fd, &st) < 0)
+	    return ERRNO("fstat"), -1;
+	if (S_ISFIFO(st.st_mode)) {
+	    int pipeSize = fcntl(fd, F_GETPIPE_SZ);
+	    if (pipeSize > 0)
+		return zpkglistSplice(z, fd, pipeSize, err);
+	}
+    }
+    // The frames are written as they are decoded, without
+    // the intermediate buffers.
+    int64_t total = 0;
+    void *buf;
+    ssize_t n;
+    while ((n = zpkglistBulk(z, &buf, err)) > 0) {
+	if (!xwrite(fd, buf, n))
+	    return ERRNO("write"), -1;
+	total += n;
+    }
+    return n < 0 ? -1 : total;
+}
+
+// With zpkglistValidate, a bad header is an error.
+#define Validate(n, blob)					\
+    if (z->validate && !headerValidate(blob, n))		\
+	return ERRSTR("bad header entries"), -1
+
 ssize_t zpkglistNextMalloc(struct zpkglistReader *z, struct HeaderBlob **blobp,
 	int64_t *posp, const char *err[2])
 {
     ConcatRead(n, opNextMalloc(z, posp, err));
+    Validate(n, z->buf);
     *blobp = z->buf, z->buf = NULL;
     return n;
 }
@@ -147,6 +357,7 @@ ssize_t zpkglistNextMallocP(struct zpkglistReader *z, struct HeaderBlob ***blobp
 	int64_t *posp, const char *err[2])
 {
     ConcatRead(n, opNextMalloc(z, posp, err));
+    Validate(n, z->buf);
     *blobpp = (void *) &z->buf;
     return n;
 }
@@ -155,10 +366,179 @@ ssize_t zpkglistNextView(struct zpkglistReader *z, struct HeaderBlob **blobp,
 	int64_t *posp, const char *err[2])
 {
     ConcatRead(n, opNextView(z, (void **) blobp, posp, err));
+    Validate(n, *blobp);
     // TODO: reallocate on a 4-byte boundary.
     return n;
 }
 
+ssize_t zpkglistNextViewNative(struct zpkglistReader *z, struct HeaderBlob **blobp,
+	const struct HeaderBlob **nativep, int64_t *posp, const char *err[2])
+{
+    ssize_t n = zpkglistNextView(z, blobp, posp, err);
+    if (n <= 0)
+	return n;
+    // The readers have checked headerDataSize.
+    unsigned il;
+    memcpy(&il, *blobp, 4);
+    il = be32toh(il);
+    size_t size = 8 + 16 * il;
+    if (size > z->nativeSize) {
+	// Grow geometrically, so that the buffer settles soon.
+	size_t newSize = z->nativeSize ? 2 * z->nativeSize : 4096;
+	while (newSize < size)
+	    newSize *= 2;
+	void *native = malloc(newSize);
+	if (!native)
+	    return ERRNO("malloc"), -1;
+	free(z->native);
+	z->native = native;
+	z->nativeSize = newSize;
+    }
+    ntohlcopy(z->native, *blobp, size / 4);
+    *nativep = z->native;
+    return n;
+}
+
+bool seeka(struct fda *fda, off_t pos, const char *mem, size_t memSize)
+{
+    // When served from memory, merely reposition the readahead,
+    // unless it has gone past the memory.
+    if (mem && fda->fpos == memSize && pos <= memSize) {
+	fda->cur = (char *) mem + pos;
+	fda->end = (char *) mem + memSize;
+	return true;
+    }
+    // Positions are relative to where the reading started, and the
+    // descriptor's offset corresponds to the end of the readahead.
+    if (lseek(fda->fd, pos - fda->fpos, SEEK_CUR) < 0)
+	return false;
+    fda->cur = fda->end = NULL;
+    fda->fpos = pos;
+    return true;
+}
+
+bool zpkglistSeek(struct zpkglistReader *z, int64_t pos, const char *err[2])
+{
+    if (!z->ops->opSeek)
+	return ERRSTR("seeking not supported"), false;
+    if (pos < 0)
+	return ERRSTR("bad position"), false;
+    return z->ops->opSeek(z, pos, err);
+}
+
+ssize_t zpkglistFrameIndex(struct zpkglistReader *z,
+	const struct zpkglistFrame **framesp, const char *err[2])
+{
+    if (!z->ops->opFrameIndex)
+	return 0;
+    return z->ops->opFrameIndex(z, framesp, err);
+}
+
+ssize_t zpkglistLookup(struct zpkglistReader *z, const char *name, const char *arch,
+	size_t *ip, struct HeaderBlob **blobp, int64_t *posp, const char *err[2])
+{
+    if (!z->ops->opLookup)
+	return ERRSTR("no name index"), -1;
+    ssize_t n = z->ops->opLookup(z, name, arch, ip, (void **) blobp, posp, err);
+    if (n > 0)
+	Validate(n, *blobp);
+    return n;
+}
+
+bool zpkglistPrefetch(struct zpkglistReader *z, int nframes, const char *err[2])
+{
+    if (nframes < 1)
+	return ERRSTR("bad number of frames"), false;
+    z->prefetch = nframes;
+    if (!z->ops->opPrefetch)
+	return true;
+    return z->ops->opPrefetch(z, nframes, err);
+}
+
+void zpkglistThreads(struct zpkglistReader *z, int nthreads)
+{
+    if (nthreads < 1) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = n > 0 ? n : 1;
+    }
+    z->threads = nthreads;
+    if (z->ops->opThreads)
+	z->ops->opThreads(z, nthreads);
+}
+
+void zpkglistValidate(struct zpkglistReader *z, bool on)
+{
+    z->validate = on;
+}
+
+void zpkglistVmsplice(struct zpkglistReader *z, bool on)
+{
+    z->vmsplice = on;
+}
+
+#define FOREACH_MAXTHREADS 256
+
+// ForEach validates in the worker threads, before the callback.
+struct validateForEach {
+    bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+		 void *arg, const char *err[2]);
+    void *arg;
+};
+
+static bool validateForEach(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+			    void *arg, const char *err[2])
+{
+    struct validateForEach *v = arg;
+    if (!headerValidate(blob, blobSize))
+	return ERROR("zpkglistForEach", "bad header entries"), false;
+    return v->func(blob, blobSize, pos, v->arg, err);
+}
+
+ssize_t zpkglistForEach(struct zpkglistReader *z, int nthreads,
+	bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+		     void *arg, const char *err[2]),
+	void *arg, const char *err[2])
+{
+    if (nthreads < 1) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = n > 0 ? n : 1;
+    }
+    // Each thread takes two frame buffers.
+    if (nthreads > FOREACH_MAXTHREADS)
+	nthreads = FOREACH_MAXTHREADS;
+    struct validateForEach v = { func, arg };
+    if (z->validate)
+	func = validateForEach, arg = &v;
+    size_t total = 0;
+    while (1) {
+	ssize_t n = 0;
+	// The pipelined mode is not combined with worker threads.
+	if (z->ops->opForEach && !z->prefetch)
+	    n = z->ops->opForEach(z, nthreads, func, arg, err);
+	else {
+	    // Run in the calling thread.
+	    void *blob;
+	    int64_t pos;
+	    ssize_t ret;
+	    while ((ret = z->ops->opNextView(z, &blob, &pos, err)) > 0) {
+		if (!func(blob, ret, pos, arg, err))
+		    return -1;
+		n++;
+	    }
+	    if (ret < 0)
+		return -1;
+	}
+	if (n < 0)
+	    return -1;
+	total += n;
+	int rc = zpkglistConcat(z, err);
+	if (rc < 0)
+	    return -1;
+	if (rc == 0)
+	    return total;
+    }
+}
+
 int64_t zpkglistContentSize(struct zpkglistReader *z)
 {
     return z->ops->opContentSize(z);
@@ -25,6 +25,8 @@
 #pragma GCC visibility push(hidden)
 
 struct zpkglistReader;
+struct zpkglistFrame;
+struct HeaderBlob;
 
 struct ops {
     // Creating stream.
@@ -42,23 +44,49 @@ struct ops {
     ssize_t (*opNextView)(struct zpkglistReader *z, void **blobp, int64_t *posp, const char *err[2]);
     // Seek to a position previously returned via posp.
     bool (*opSeek)(struct zpkglistReader *z, int64_t pos, const char *err[2]);
+    // The index of data frames.
+    ssize_t (*opFrameIndex)(struct zpkglistReader *z, const struct zpkglistFrame **framesp,
+			    const char *err[2]);
+    // Header lookup by name, works like opNextView.
+    ssize_t (*opLookup)(struct zpkglistReader *z, const char *name, const char *arch,
+			size_t *ip, void **blobp, int64_t *posp, const char *err[2]);
+    // Background decoding.
+    bool (*opPrefetch)(struct zpkglistReader *z, int nframes, const char *err[2]);
+    // Parallel processing of the rest of the stream.
+    ssize_t (*opForEach)(struct zpkglistReader *z, int nthreads,
+	    bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+			 void *arg, const char *err[2]),
+	    void *arg, const char *err[2]);
+    // The number of threads decoding a single stream.
+    void (*opThreads)(struct zpkglistReader *z, int nthreads);
 };
 
 extern const struct ops
     ops_rpmheader,
     ops_zpkglist,
     ops_zstd,
-    ops_xz;
+    ops_xz,
+    ops_lz4;
 
 // Reallocate z->buf for opNextMalloc.
 void *generic_opHdrBuf(struct zpkglistReader *z, size_t size);
 
+// Reposition the input descriptor, discarding the readahead.
+// When served from memory, merely repositions the readahead.
+bool seeka(struct fda *fda, off_t pos, const char *mem, size_t memSize);
+
 struct zpkglistReader {
     // The underlying reader handle, e.g. xzreader.
     void *reader;
     // The input descriptor with readahead.
     struct fda fda;
     char fdabuf[NREADA];
+    // The readahead can be served from memory, which corresponds to
+    // the position 0: a caller's buffer, or a regular file mapped.
+    const char *mem;
+    size_t memSize;
+    void *map;
+    size_t mapSize;
     const struct ops *ops;
     void *readState;
     // Reading headers.
@@ -67,9 +95,20 @@ struct zpkglistReader {
     bool eof;
     // op-rpmheader.c
     size_t left;
+    // The number of frames to decode ahead, see zpkglistPrefetch.
+    int prefetch;
+    // The number of decoding threads, see zpkglistThreads.
+    int threads;
+    // Check the headers, see zpkglistValidate.
+    bool validate;
+    // Splice into pipes, see zpkglistVmsplice.
+    bool vmsplice;
     // A malloc'd buffer.
     void *buf;
     size_t bufSize;
+    // The header's index in host byte order, see zpkglistNextViewNative.
+    void *native;
+    size_t nativeSize;
 };
 
 #define CAT_(x, y) x ## y
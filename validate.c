@@ -0,0 +1,270 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <string.h>
+#include <arpa/inet.h>
+#include "header.h"
+#include "validate.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define X86 1
+#endif
+
+// The blob is not necessarily aligned.
+static inline unsigned load32(const void *p)
+{
+    unsigned x;
+    memcpy(&x, p, 4);
+    return ntohl(x);
+}
+
+// Element sizes, indexed by type, RPM_CHAR_TYPE through RPM_I18NSTRING_TYPE.
+// Strings take at least one byte each, and so do RPM_BIN_TYPE elements.
+static const unsigned char typeSize[16] = { 0, 1, 1, 2, 4, 8, 1, 1, 1, 1 };
+
+// Check n entries, the previous entry's data ending at *endp.
+// Updates *endp, which is a lower bound if the last entry is strings.
+static bool entriesScalar(const char *ee, size_t n, unsigned dl, unsigned *endp)
+{
+    unsigned end = *endp;
+    for (size_t i = 0; i < n; i++, ee += 16) {
+	unsigned type = load32(ee + 4);
+	unsigned off = load32(ee + 8);
+	unsigned cnt = load32(ee + 12);
+	if (type - 1 > 8 || off >= dl || cnt - 1 >= dl)
+	    return false;
+	unsigned size = typeSize[type];
+	if (off & (size - 1))
+	    return false;
+	if (off < end)
+	    return false;
+	// Cannot overflow, dl being under 16M.
+	end = off + cnt * size;
+	if (end > dl)
+	    return false;
+    }
+    *endp = end;
+    return true;
+}
+
+// Whether there are at least cnt zero bytes in p[0..size).
+static bool nulsScalar(const char *p, size_t size, unsigned cnt)
+{
+    const char *end = p + size;
+    while (cnt--) {
+	const char *z = memchr(p, '\0', end - p);
+	if (!z)
+	    return false;
+	p = z + 1;
+    }
+    return true;
+}
+
+#ifdef X86
+// The vectorized versions transpose the entries, so that each vector holds
+// one field of 4 or 8 entries, and run the same checks as entriesScalar,
+// comparing unsigned numbers with min_epu32.
+
+#define ULE(x, y) _mm_cmpeq_epi32(_mm_min_epu32(x, y), x)
+
+__attribute__((target("sse4.1")))
+static bool entriesSSE41(const char *ee, size_t n, unsigned dl, unsigned *endp)
+{
+    const __m128i bswap = _mm_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					11, 10, 9, 8, 15, 14, 13, 12);
+    const __m128i one = _mm_set1_epi32(1), eight = _mm_set1_epi32(8);
+    const __m128i t16 = _mm_set1_epi32(3), t32 = _mm_set1_epi32(4), t64 = _mm_set1_epi32(5);
+    const __m128i m16 = _mm_set1_epi32(1), m32 = _mm_set1_epi32(3), m64 = _mm_set1_epi32(7);
+    const __m128i dl0 = _mm_set1_epi32(dl), dl1 = _mm_set1_epi32(dl - 1);
+    __m128i end = _mm_set1_epi32(*endp);
+    __m128i ok = _mm_set1_epi32(-1);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4, ee += 64) {
+	const __m128i *v = (const __m128i *) ee;
+	__m128i e0 = _mm_shuffle_epi8(_mm_loadu_si128(v + 0), bswap);
+	__m128i e1 = _mm_shuffle_epi8(_mm_loadu_si128(v + 1), bswap);
+	__m128i e2 = _mm_shuffle_epi8(_mm_loadu_si128(v + 2), bswap);
+	__m128i e3 = _mm_shuffle_epi8(_mm_loadu_si128(v + 3), bswap);
+	__m128i a = _mm_unpacklo_epi32(e0, e1);
+	__m128i b = _mm_unpacklo_epi32(e2, e3);
+	__m128i c = _mm_unpackhi_epi32(e0, e1);
+	__m128i d = _mm_unpackhi_epi32(e2, e3);
+	__m128i type = _mm_unpackhi_epi64(a, b);
+	__m128i off = _mm_unpacklo_epi64(c, d);
+	__m128i cnt = _mm_unpackhi_epi64(c, d);
+	__m128i t1 = _mm_sub_epi32(type, one);
+	__m128i c1 = _mm_sub_epi32(cnt, one);
+	ok = _mm_and_si128(ok, ULE(t1, eight));
+	ok = _mm_and_si128(ok, ULE(off, dl1));
+	ok = _mm_and_si128(ok, ULE(c1, dl1));
+	__m128i mask = _mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(type, t16), m16),
+			_mm_or_si128(_mm_and_si128(_mm_cmpeq_epi32(type, t32), m32),
+				     _mm_and_si128(_mm_cmpeq_epi32(type, t64), m64)));
+	ok = _mm_and_si128(ok, _mm_cmpeq_epi32(_mm_and_si128(off, mask), _mm_setzero_si128()));
+	__m128i next = _mm_add_epi32(off, _mm_mullo_epi32(cnt, _mm_add_epi32(mask, one)));
+	// The previous ends: the last one from the previous iteration,
+	// followed by the first three from this iteration.
+	__m128i prev = _mm_alignr_epi8(next, end, 12);
+	ok = _mm_and_si128(ok, ULE(prev, off));
+	ok = _mm_and_si128(ok, ULE(next, dl0));
+	end = next;
+    }
+    if (_mm_movemask_epi8(ok) != 0xffff)
+	return false;
+    *endp = _mm_extract_epi32(end, 3);
+    return entriesScalar(ee, n - i, dl, endp);
+}
+
+#define ULE256(x, y) _mm256_cmpeq_epi32(_mm256_min_epu32(x, y), x)
+
+__attribute__((target("avx2")))
+static bool entriesAVX2(const char *ee, size_t n, unsigned dl, unsigned *endp)
+{
+    const __m256i bswap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+					   11, 10, 9, 8, 15, 14, 13, 12,
+					   3, 2, 1, 0, 7, 6, 5, 4,
+					   11, 10, 9, 8, 15, 14, 13, 12);
+    const __m256i one = _mm256_set1_epi32(1), eight = _mm256_set1_epi32(8);
+    const __m256i t16 = _mm256_set1_epi32(3), t32 = _mm256_set1_epi32(4), t64 = _mm256_set1_epi32(5);
+    const __m256i m16 = _mm256_set1_epi32(1), m32 = _mm256_set1_epi32(3), m64 = _mm256_set1_epi32(7);
+    const __m256i dl0 = _mm256_set1_epi32(dl), dl1 = _mm256_set1_epi32(dl - 1);
+    // After unpacking within 128-bit lanes, the entries come in the order
+    // 0 2 4 6 1 3 5 7; the offsets and ends are put back in order.
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i rotate = _mm256_setr_epi32(7, 0, 1, 2, 3, 4, 5, 6);
+    __m256i prevRot = _mm256_set1_epi32(*endp);
+    __m256i ok = _mm256_set1_epi32(-1);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8, ee += 128) {
+	const __m256i *v = (const __m256i *) ee;
+	__m256i e0 = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 0), bswap);
+	__m256i e1 = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 1), bswap);
+	__m256i e2 = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 2), bswap);
+	__m256i e3 = _mm256_shuffle_epi8(_mm256_loadu_si256(v + 3), bswap);
+	__m256i a = _mm256_unpacklo_epi32(e0, e1);
+	__m256i b = _mm256_unpacklo_epi32(e2, e3);
+	__m256i c = _mm256_unpackhi_epi32(e0, e1);
+	__m256i d = _mm256_unpackhi_epi32(e2, e3);
+	__m256i type = _mm256_unpackhi_epi64(a, b);
+	__m256i off = _mm256_unpacklo_epi64(c, d);
+	__m256i cnt = _mm256_unpackhi_epi64(c, d);
+	__m256i t1 = _mm256_sub_epi32(type, one);
+	__m256i c1 = _mm256_sub_epi32(cnt, one);
+	ok = _mm256_and_si256(ok, ULE256(t1, eight));
+	ok = _mm256_and_si256(ok, ULE256(off, dl1));
+	ok = _mm256_and_si256(ok, ULE256(c1, dl1));
+	__m256i mask = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi32(type, t16), m16),
+			_mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi32(type, t32), m32),
+					_mm256_and_si256(_mm256_cmpeq_epi32(type, t64), m64)));
+	ok = _mm256_and_si256(ok, _mm256_cmpeq_epi32(_mm256_and_si256(off, mask),
+						     _mm256_setzero_si256()));
+	__m256i next = _mm256_add_epi32(off, _mm256_mullo_epi32(cnt, _mm256_add_epi32(mask, one)));
+	ok = _mm256_and_si256(ok, ULE256(next, dl0));
+	off = _mm256_permutevar8x32_epi32(off, order);
+	next = _mm256_permutevar8x32_epi32(next, order);
+	// Rotated, the first element is the last end.
+	__m256i rot = _mm256_permutevar8x32_epi32(next, rotate);
+	__m256i prev = _mm256_blend_epi32(rot, prevRot, 1);
+	ok = _mm256_and_si256(ok, ULE256(prev, off));
+	prevRot = rot;
+    }
+    if (_mm256_movemask_epi8(ok) != -1)
+	return false;
+    *endp = _mm256_cvtsi256_si32(prevRot);
+    return entriesScalar(ee, n - i, dl, endp);
+}
+
+__attribute__((target("sse4.1")))
+static bool nulsSSE41(const char *p, size_t size, unsigned cnt)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (; size >= 16; p += 16, size -= 16) {
+	__m128i x = _mm_loadu_si128((const __m128i *) p);
+	unsigned k = __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(x, zero)));
+	if (k >= cnt)
+	    return true;
+	cnt -= k;
+    }
+    return nulsScalar(p, size, cnt);
+}
+
+__attribute__((target("avx2,popcnt")))
+static bool nulsAVX2(const char *p, size_t size, unsigned cnt)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    for (; size >= 32; p += 32, size -= 32) {
+	__m256i x = _mm256_loadu_si256((const __m256i *) p);
+	unsigned k = __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, zero)));
+	if (k >= cnt)
+	    return true;
+	cnt -= k;
+    }
+    return nulsScalar(p, size, cnt);
+}
+#endif
+
+bool headerValidate(const void *blob, size_t size)
+{
+    bool (*entries)(const char *ee, size_t n, unsigned dl, unsigned *endp) = entriesScalar;
+    bool (*nuls)(const char *p, size_t size, unsigned cnt) = nulsScalar;
+#ifdef X86
+    if (__builtin_cpu_supports("avx2"))
+	entries = entriesAVX2, nuls = nulsAVX2;
+    else if (__builtin_cpu_supports("sse4.1"))
+	entries = entriesSSE41, nuls = nulsSSE41;
+#endif
+    if (size < 8)
+	return false;
+    const char *ei = blob;
+    unsigned il = load32(ei + 0);
+    unsigned dl = load32(ei + 4);
+    if (il - 1 > headerMaxTags - 1 || dl - 1 > headerMaxData - 1)
+	return false;
+    if (size != 8 + 16 * il + dl)
+	return false;
+    const char *ee = ei + 8;
+    const char *data = ee + 16 * il;
+    // The region tag, if present, comes first, and points to the trailer
+    // at the end of the region; it is exempt from the ordering.
+    unsigned end = 0;
+    size_t skip = 0;
+    if (load32(ee) - 61 <= 63 - 61) {
+	if (!entriesScalar(ee, 1, dl, &end))
+	    return false;
+	end = 0, skip = 1;
+    }
+    if (!entries(ee + 16 * skip, il - skip, dl, &end))
+	return false;
+    // The entries are good, check the strings.
+    for (const char *e = ee; e < data; e += 16) {
+	unsigned type = load32(e + 4);
+	if (type != 6 && type != 8 && type != 9)
+	    continue;
+	unsigned off = load32(e + 8);
+	unsigned cnt = load32(e + 12);
+	// RPM_STRING_TYPE holds a single string.
+	if (type == 6 && cnt != 1)
+	    return false;
+	if (!nuls(data + off, dl - off, cnt))
+	    return false;
+    }
+    return true;
+}
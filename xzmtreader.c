@@ -0,0 +1,154 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <lzma.h>
+#include "xzmtreader.h"
+#include "xzreader.h"
+#include "reada.h"
+#include "error.h"
+
+struct xzmtreader {
+    struct fda *fda;
+    // The single-threaded reader, opened on demand.
+    struct xzreader *xz;
+    // The multithreaded decoder.
+    lzma_stream lz;
+    bool lzInit;
+    // The current stream is being decoded by lz rather than xz.
+    bool mt;
+    // The decoder for the current stream has yet to be set up.
+    bool pending;
+    bool eos;
+    int nthreads;
+};
+
+int xzmtreader_open(struct xzmtreader **zp, struct fda *fda, const char *err[2])
+{
+    struct xzmtreader *z = malloc(sizeof *z);
+    if (!z)
+	return ERRNO("malloc"), -1;
+    *z = (struct xzmtreader) {
+	.fda = fda,
+	.lz = LZMA_STREAM_INIT,
+	.pending = true,
+	.nthreads = 1,
+    };
+    *zp = z;
+    return 1;
+}
+
+int xzmtreader_reopen(struct xzmtreader *z, struct fda *fda, const char *err[2])
+{
+    z->fda = fda;
+    z->pending = true;
+    return 1;
+}
+
+void xzmtreader_free(struct xzmtreader *z)
+{
+    if (!z)
+	return;
+    xzreader_free(z->xz);
+    if (z->lzInit)
+	lzma_end(&z->lz);
+    free(z);
+}
+
+void xzmtreader_threads(struct xzmtreader *z, int nthreads)
+{
+    z->nthreads = nthreads;
+}
+
+static bool xzmtreader_begin(struct xzmtreader *z, const char *err[2])
+{
+    z->pending = false;
+    z->eos = false;
+    z->mt = z->nthreads > 1;
+    if (!z->mt) {
+	int rc = z->xz ? xzreader_reopen(z->xz, z->fda, err)
+		       : xzreader_open(&z->xz, z->fda, err);
+	if (rc < 0)
+	    return false;
+	if (rc == 0)
+	    return ERRSTR("unexpected EOF"), false;
+	return true;
+    }
+    // Only multi-block streams with the sizes stored in block headers,
+    // such as written by xz -T, are split between the threads.  Otherwise,
+    // liblzma decodes in the calling thread, same as lzma_stream_decoder.
+    // The memory limit for threading is advisory: with a big stream, it
+    // makes the decoder fall back to fewer threads rather than fail.
+    uint64_t physmem = lzma_physmem();
+    lzma_mt mt = {
+	.threads = z->nthreads,
+	.memlimit_threading = physmem ? physmem / 4 : UINT64_MAX,
+	.memlimit_stop = UINT64_MAX,
+    };
+    // Reinitialization of the same decoder type reuses its threads.
+    lzma_ret ret = lzma_stream_decoder_mt(&z->lz, &mt);
+    if (ret != LZMA_OK)
+	return ERROR("lzma_stream_decoder_mt", ret == LZMA_MEM_ERROR ?
+		     "out of memory" : "cannot initialize decoder"), false;
+    z->lzInit = true;
+    return true;
+}
+
+ssize_t xzmtreader_read(struct xzmtreader *z, void *buf, size_t size, const char *err[2])
+{
+    if (z->pending && !xzmtreader_begin(z, err))
+	return -1;
+    if (!z->mt)
+	return xzreader_read(z->xz, buf, size, err);
+    z->lz.next_out = buf;
+    z->lz.avail_out = size;
+    while (z->lz.avail_out && !z->eos) {
+	// Decode right from the readahead buffer.  The decoder stops
+	// at the end of the stream, the rest of the input is left intact.
+	if (z->fda->cur == z->fda->end) {
+	    ssize_t n = filla(z->fda, 1);
+	    if (n < 0)
+		return ERRNO("read"), -1;
+	    if (n == 0)
+		return ERRSTR("unexpected EOF"), -1;
+	}
+	z->lz.next_in = (const uint8_t *) z->fda->cur;
+	z->lz.avail_in = z->fda->end - z->fda->cur;
+	lzma_ret ret = lzma_code(&z->lz, LZMA_RUN);
+	z->fda->cur = (char *) z->lz.next_in;
+	if (ret == LZMA_STREAM_END)
+	    z->eos = true;
+	else if (ret != LZMA_OK) {
+	    switch (ret) {
+	    case LZMA_MEM_ERROR:
+		return ERROR("lzma_code", "out of memory"), -1;
+	    case LZMA_FORMAT_ERROR:
+		return ERROR("lzma_code", "not an xz stream"), -1;
+	    case LZMA_DATA_ERROR:
+		return ERROR("lzma_code", "data is corrupt"), -1;
+	    default:
+		return ERROR("lzma_code", "decoding failed"), -1;
+	    }
+	}
+    }
+    return size - z->lz.avail_out;
+}
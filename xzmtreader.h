@@ -0,0 +1,53 @@
+// Copyright (c) 2018 Alexey Tourbin
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+
+#include <stdint.h>
+#include <sys/types.h> // ssize_t
+
+#pragma GCC visibility push(hidden)
+
+struct fda; // reada.h
+struct xzmtreader;
+
+// Decompress xz streams, possibly with liblzma's multithreaded decoder.
+// The interface is that of xzreader, which still handles the single-threaded
+// case.  The decoder is set up lazily, on the first read, so that the number
+// of threads can be changed right after open.  Returns 1 on success, -1 on
+// error (the magic must have been checked by the caller).
+int xzmtreader_open(struct xzmtreader **zp, struct fda *fda, const char *err[2])
+		    __attribute__((nonnull));
+
+// Start decoding the next concatenated stream.  Returns 1 or -1.
+int xzmtreader_reopen(struct xzmtreader *z, struct fda *fda, const char *err[2])
+		      __attribute__((nonnull));
+
+void xzmtreader_free(struct xzmtreader *z);
+
+// Returns the number of bytes decompressed, which is less than size only
+// at the end of the stream, -1 on error.
+ssize_t xzmtreader_read(struct xzmtreader *z, void *buf, size_t size, const char *err[2])
+			__attribute__((nonnull));
+
+// The number of decoding threads, 1 by default.
+// Takes effect with the next stream which hasn't been started yet.
+void xzmtreader_threads(struct xzmtreader *z, int nthreads) __attribute__((nonnull));
+
+#pragma GCC visibility pop
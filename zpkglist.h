@@ -20,6 +20,7 @@
 
 #pragma once
 #include <sys/types.h> // ssize_t
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -41,13 +42,136 @@ ssize_t zpkglistCompress(int infd, int outfd,
 			 void (*hash)(const void *buf, size_t size, void *arg),
 			 void *arg, const char *err[2]) __attribute__((nonnull(5)));
 
+// Like zpkglistCompress, but compresses the frames in parallel, using
+// the specified number of threads (0 means the number of online CPUs).
+// The output is identical to that of zpkglistCompress, and the hash()
+// function is still called in order, from the calling thread.
+ssize_t zpkglistCompressMT(int infd, int outfd,
+			   void (*hash)(const void *buf, size_t size, void *arg),
+			   void *arg, int nthreads, const char *err[2])
+			   __attribute__((nonnull(6)));
+
+// Compression options, zero-initialized for the defaults.
+struct zpkglistCompressOptions {
+    // The number of threads, as with zpkglistCompressMT
+    // (0 means the number of online CPUs).
+    int nthreads;
+    // The compression level.  The default, 0, is the fast LZ4 compression.
+    // Levels 1..12 select LZ4HC, which is much slower but gives smaller
+    // frames, which still decompress just as fast.  The format is the same.
+    int level;
+    // The acceleration factor for the fast LZ4 compression (level 0).
+    // The default, 0 or 1, is the normal speed.  Bigger values compress
+    // faster, trading off the compression ratio.
+    int accel;
+    // Compress the frames with zstd rather than LZ4, using the same
+    // dictionary.  This gives much smaller output, at the cost of slower
+    // decompression.  The level is then the zstd level (0 means the zstd
+    // default).  Older decoders cannot read such files.
+    bool zstd;
+    // Append to an existing zpkglist file, as with zpkglistAppend.
+    bool append;
+    // Write the index frames after the data frames, which enables
+    // zpkglistFrameIndex and zpkglistLookup.  Older decoders cannot read
+    // such files, hence off by default.  When appending, the index is kept
+    // if the file has it, and cannot be added if it doesn't.
+    bool index;
+};
+
+// Like zpkglistCompress, with options (NULL means the defaults).
+ssize_t zpkglistCompress2(int infd, int outfd,
+			  void (*hash)(const void *buf, size_t size, void *arg),
+			  void *arg, const struct zpkglistCompressOptions *opt,
+			  const char *err[2]) __attribute__((nonnull(6)));
+
+// Append the headers to an existing zpkglist file, without recompressing
+// the old ones.  The output descriptor must be a regular file opened for
+// reading and writing, and positioned at the leading frame.  The new frames
+// are written after the old data frames, followed by the updated index
+// frames, and the leading frame is rewritten.  The list must run up to
+// the end of the file (e.g. concatenated lists are refused).  The old index
+// frames are overwritten in place, so the operation is not crash-safe:
+// the leading frame is only rewritten once the rest is synced to disk,
+// but until then, the file has lost its index and may end with a partial
+// frame.  Returns the number of new headers, 0 on empty input (the file
+// is left intact), -1 on error.
+ssize_t zpkglistAppend(int infd, int outfd,
+		       void (*hash)(const void *buf, size_t size, void *arg),
+		       void *arg, int nthreads, const char *err[2])
+		       __attribute__((nonnull(6)));
+
+// Merge zpkglist files into one, without recompression: the data frames
+// are copied verbatim, and only the leading frame and the index frames
+// are rebuilt.  The inputs can be pipes, and can be concatenated lists
+// themselves.  The output must be seekable, as with zpkglistCompress.
+// Returns the number of data frames (unlike zpkglistCompress, which counts
+// the headers: the frames are not decoded, and without the index, the number
+// of headers is not known), 0 if all the inputs are empty (with valid output
+// still written), -1 on error.
+ssize_t zpkglistMerge(int outfd, const int *infds, size_t n,
+		      const char *err[2]) __attribute__((nonnull(4)));
+
+// Split a zpkglist file into k shards, which are valid zpkglist files
+// on their own, at data frame boundaries, without recompression.
+// The shards are balanced by the uncompressed size (some shards can be
+// empty if there are too few frames).  Concatenated input is not supported.
+// Returns the number of data frames, as with zpkglistMerge, 0 on empty
+// input, -1 on error.
+ssize_t zpkglistSplit(int infd, const int *outfds, size_t k,
+		      const char *err[2]) __attribute__((nonnull(4)));
+
 // For decompression, a more general "Reader" API is provided.
 struct zpkglistReader;
 // Returns 1 on success, 0 on EOF at the beginning of input
 // (no headers, the Reader handle is not created), -1 on error.
-// On success, the Reader handle is returned via zp.
+// On success, the Reader handle is returned via zp.  A regular file is
+// mapped into memory, so that the data is read right from the mapping
+// (the descriptor's offset is then moved to the end of the file).
 int zpkglistFdopen(struct zpkglistReader **zp, int fd, const char *err[2])
 		   __attribute__((nonnull));
+// Like zpkglistFdopen, but reads from the caller's buffer, which must
+// stay intact until the Reader handle is freed.  The header blobs are
+// returned as views right into the buffer, or decoded right from there.
+int zpkglistMemopen(struct zpkglistReader **zp, const void *buf, size_t size,
+		    const char *err[2]) __attribute__((nonnull(1,4)));
+// Like zpkglistFdopen, but reads the data with the readfunc() callback,
+// which works like read(2): returns the number of bytes read, 0 on EOF,
+// -1 on error (with errno set, which is then reported as the read error).
+// The callback is invoked by the thread that reads, i.e. the caller's
+// thread, unless zpkglistPrefetch or zpkglistForEach is used.  Seeking
+// is not supported, nor is the index available.
+int zpkglistReadopen(struct zpkglistReader **zp,
+		     ssize_t (*readfunc)(void *buf, size_t size, void *arg),
+		     void *arg, const char *err[2]) __attribute__((nonnull(1,2,4)));
+// Enable the pipelined mode: a background thread decodes up to nframes
+// frames ahead, while the caller consumes the current one.  The semantics
+// of the reading functions stay the same.  Currently only zpkglist frames
+// are decoded in the background; with other formats, the call is a no-op.
+// Should be called before reading; the mode persists across concatenated
+// streams and seeks.  Returns true on success, false on error.
+bool zpkglistPrefetch(struct zpkglistReader *z, int nframes, const char *err[2])
+		      __attribute__((nonnull));
+// Decode a single stream with up to nthreads threads (0 means the number
+// of online CPUs, the default is 1).  Currently only xz streams which have
+// multiple blocks, e.g. written with xz -T, are decoded in parallel; the
+// setting has no effect with other formats.  The change applies starting
+// with the next stream, so it should be made before reading; it persists
+// across concatenated streams.
+void zpkglistThreads(struct zpkglistReader *z, int nthreads) __attribute__((nonnull));
+// Check each header before returning it: the entries must have valid types,
+// and their data must be aligned, in order and within the data segment;
+// strings must be terminated.  A bad header is then a read error, rather
+// than something for librpm to choke on.  The check runs at several GB/s,
+// with AVX2 or SSE4.1 on x86.  Off by default.
+void zpkglistValidate(struct zpkglistReader *z, bool on) __attribute__((nonnull));
+// Let zpkglistDecompressFd splice the data into a pipe with vmsplice(2):
+// the data is decoded into a few page-aligned buffers, which spares the copy
+// into the kernel.  The pages are reused as soon as they are known to have
+// left the pipe, and the pipe must not be resized meanwhile.  Whoever reads
+// the pipe must therefore copy the data (i.e. read it), rather than splice
+// it further (as tee or pv do), or else it will see the data overwritten.
+// Off by default, the data is written with write(2).
+void zpkglistVmsplice(struct zpkglistReader *z, bool on) __attribute__((nonnull));
 // Free without closing.
 void zpkglistFree(struct zpkglistReader *z);
 // Combines free + close.
@@ -71,6 +195,12 @@ ssize_t zpkglistRead(struct zpkglistReader *z, void *buf, size_t size,
 ssize_t zpkglistBulk(struct zpkglistReader *z, void **bufp,
 		     const char *err[2]) __attribute__((nonnull));
 
+// Write the rest of the uncompressed data to fd, as with zpkglistBulk.
+// With zpkglistVmsplice, the data can be spliced into a pipe instead.
+// Returns the number of bytes written, -1 on error.
+int64_t zpkglistDecompressFd(struct zpkglistReader *z, int fd,
+			     const char *err[2]) __attribute__((nonnull));
+
 // Exposes the inner workings of a blob.
 // All integers are in network byte order.
 struct HeaderBlob {
@@ -87,7 +217,54 @@ struct HeaderBlob {
     } ee[];
 };
 
-#include <stdint.h>
+// Find the tag in the header blob, blobSize being the size returned along
+// with the blob.  On disk, ee[] is ordered by offset rather than by tag, so
+// the lookup is a linear scan, which for package list headers (with a few
+// dozen tags) is fast anyway.  The value is checked to be within the data
+// segment; for string types, the strings are checked to be terminated.
+// The data pointer points into the blob, the integers being in network byte
+// order, and the count is as recorded in the entry (for RPM_BIN_TYPE, it is
+// the size in bytes).  Returns false if there is no such tag, or if the
+// entry is malformed.
+bool zpkglistBlobGet(const struct HeaderBlob *blob, size_t blobSize, int tag,
+		     int *typep, const void **datap, unsigned *countp)
+		     __attribute__((nonnull));
+
+// Typed helpers, which return NULL if the tag is not found or is not of the
+// expected type.  For RPM_I18NSTRING_TYPE, the first (untranslated) string
+// is returned.
+const char *zpkglistBlobGetString(const struct HeaderBlob *blob, size_t blobSize,
+				  int tag) __attribute__((nonnull));
+// The strings follow one another, each terminated with '\0'.
+// RPM_STRING_TYPE is treated as an array of one string.
+const char *zpkglistBlobGetStringArray(const struct HeaderBlob *blob, size_t blobSize,
+				       int tag, unsigned *countp) __attribute__((nonnull));
+// The numbers are in network byte order.  The array is aligned to a multiple
+// of 4 bytes if the blob is.
+const uint32_t *zpkglistBlobGetInt32Array(const struct HeaderBlob *blob, size_t blobSize,
+					  int tag, unsigned *countp) __attribute__((nonnull));
+
+// Projection: rebuild headers with only the selected tags, e.g. to publish
+// slim package lists.  The entries keep their order, and their data is laid
+// out anew, properly aligned, so the result is a valid header blob.  Region
+// tags are dropped, since they would cover the data which is gone; the i18n
+// table is kept along with any RPM_I18NSTRING_TYPE entry.
+struct zpkglistProjection;
+struct zpkglistProjection *zpkglistProjectionNew(const int *tags, size_t ntags,
+						 const char *err[2]) __attribute__((nonnull(3)));
+void zpkglistProjectionFree(struct zpkglistProjection *p);
+// Project a single blob into an internal buffer, which is reused in the next
+// call (and is aligned to a multiple of 4 bytes).  Returns the size of the
+// new blob, 0 if the header has none of the tags (no blob), -1 on error.
+ssize_t zpkglistProject(struct zpkglistProjection *p,
+	const struct HeaderBlob *blob, size_t blobSize,
+	struct HeaderBlob **outp, const char *err[2]) __attribute__((nonnull));
+// Project the rest of the headers from the reader, writing them to fd
+// with the magic, i.e. in the format which zpkglistCompress takes as input.
+// Headers with none of the tags are skipped.  Returns the number of headers
+// written, -1 on error.
+int64_t zpkglistProjectFd(struct zpkglistReader *z, struct zpkglistProjection *p,
+			  int fd, const char *err[2]) __attribute__((nonnull));
 
 // Read the next header blob, malloc a buffer.
 ssize_t zpkglistNextMalloc(struct zpkglistReader *z, struct HeaderBlob **blobp,
@@ -106,6 +283,73 @@ ssize_t zpkglistNextMallocP(struct zpkglistReader *z, struct HeaderBlob ***blobp
 ssize_t zpkglistNextView(struct zpkglistReader *z, struct HeaderBlob **blobp,
 	int64_t *posp, const char *err[2]) __attribute__((nonnull(1,2,4)));
 
+// Like NextView, and also put a copy of the blob's il, dl and ee[] in host
+// byte order into another internal buffer, aligned to a multiple of 8 bytes.
+// The data segment is not copied: it is still found in the blob, after ee[].
+// Both buffers are reused in the next call.
+ssize_t zpkglistNextViewNative(struct zpkglistReader *z, struct HeaderBlob **blobp,
+	const struct HeaderBlob **nativep, int64_t *posp, const char *err[2])
+	__attribute__((nonnull(1,2,3,5)));
+
+// Seek to a position previously returned via posp by NextMalloc/NextView,
+// so that the next call returns the same header again.  Only positions
+// from the same stream are valid (concatenated inputs are different streams).
+// Not all formats support seeking: the position of a header in a zstd or xz
+// stream is returned as -1.  The exception is a zstd file in the seekable
+// format, i.e. with the seek table at the end, read from a regular file or
+// memory; seeking then decodes only the relevant zstd frame.  Returns true
+// on success, false on error.
+bool zpkglistSeek(struct zpkglistReader *z, int64_t pos, const char *err[2])
+		  __attribute__((nonnull));
+
+// The index of data frames, as recorded at the end of a zpkglist file.
+struct zpkglistFrame {
+    // The position of the frame's first header, as returned via posp;
+    // the position of the next header in the frame is pos + 1, etc.
+    int64_t pos;
+    // The frame's uncompressed size, not including the leading magic.
+    unsigned size;
+    // The number of header blobs in the frame.
+    unsigned count;
+};
+
+// Load the index of data frames, which permits seeking to an arbitrary
+// header, counting the headers, and splitting the work.  The index is only
+// available when reading a regular file (or memory) written with the index
+// option.  Returns the number of frames, 0 if there is no index, -1 on error.
+// The pointer to the internal array is returned via framesp; it belongs
+// to the stream being read.
+ssize_t zpkglistFrameIndex(struct zpkglistReader *z,
+	const struct zpkglistFrame **framesp, const char *err[2])
+	__attribute__((nonnull));
+
+// Find a header blob by name (and by arch, unless arch is NULL), using
+// the name index stored in a zpkglist file, so that only the relevant frames
+// are decoded.  Since there can be a few headers with the same name, the
+// function can be called repeatedly to find them all: the *ip counter, which
+// must initially be set to 0, tracks the candidates already examined.
+// On success, returns the blob as with NextView; the reader is positioned
+// after the blob.  Returns 0 if no (more) headers are found, -1 on error,
+// including when the file has no name index (it is only written along with
+// the index, see zpkglistCompressOptions).
+ssize_t zpkglistLookup(struct zpkglistReader *z, const char *name, const char *arch,
+	size_t *ip, struct HeaderBlob **blobp, int64_t *posp, const char *err[2])
+	__attribute__((nonnull(1,2,4,5,7)));
+
+// Process the rest of the header blobs with the func() callback, using
+// nthreads worker threads (0 means the number of online CPUs; the number
+// is capped at 256).  Whole zpkglist frames are handed out to the threads,
+// so func() is called concurrently and in no particular order, with the
+// blob's position as with NextView.
+// The blob is only valid during the call.  On error, func() should return
+// false and fill err.  Other formats, as well as the pipelined mode, are
+// processed in the calling thread.  Returns the number of headers processed,
+// -1 on error.
+ssize_t zpkglistForEach(struct zpkglistReader *z, int nthreads,
+	bool (*func)(struct HeaderBlob *blob, size_t blobSize, int64_t pos,
+		     void *arg, const char *err[2]),
+	void *arg, const char *err[2]) __attribute__((nonnull(1,3,5)));
+
 // Returns the size the data stream, i.e. the sum of the header blob sizes,
 // including the leading magic bytes stripped from struct HeaderBlob.
 // Note however that the library concatenates compressed streams transparently;
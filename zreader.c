@@ -23,12 +23,18 @@
 #include <string.h>
 #include <assert.h>
 #include <endian.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <pthread.h>
 #include <lz4.h>
+#include <zstd.h>
+#include "zpkglist.h"
 #include "zreader.h"
 #include "error.h"
 #include "reada.h"
 #include "header.h"
 #include "magic4.h"
+#include "reader.h" // seeka
 
 struct zreader {
     struct fda *fda;
@@ -46,10 +52,38 @@ struct zreader {
     char save[8];
     // The leading fields of a data frame to read.
     unsigned lead[3];
+    // The magic of the data frames, which tells the codec.  With zstd,
+    // the dictionary is also loaded as ZSTD_DDict, shared by the threads.
+    unsigned dataMagic;
+    ZSTD_DDict *ddict;
+    ZSTD_DCtx *dctx;
+    // The data frames may be followed by the index frames, to be skipped.
+    bool trailer;
+    // The readahead can be served from memory (the position 0 corresponds
+    // to mem), then the data stays put.
+    const char *mem;
+    size_t memSize;
+    // The position of the leading frame, and the file offset
+    // which corresponds to the position 0 (or -1 if not seekable).
+    off_t pos0, base;
+    // The index of data frames and the name index, loaded on demand.
+    bool indexLoaded;
+    size_t nindex, nnames;
+    struct zpkglistFrame *index;
+    struct zreaderName *names;
+    // The pipelined mode, see zreader_prefetch.
+    struct prefetch *pf;
 };
 
 static int zreader_begin(struct zreader *z, const char *err[2])
 {
+    z->pos0 = tella(z->fda);
+    // Find out the file offset now, with the prefetch thread running,
+    // the offset will be a moving target.
+    z->base = lseek(z->fda->fd, 0, SEEK_CUR);
+    if (z->base >= 0)
+	z->base -= z->fda->fpos;
+
     // Read the leading frame.
     struct {
 	unsigned magic;
@@ -101,8 +135,13 @@ static int zreader_begin(struct zreader *z, const char *err[2])
     ret = peeka(z->fda, w, sizeof w);
     if (ret < 0)
 	return ERRNO("read"), -1;
-    // Do we have a dictionary magic?
-    if (ret < 4 || w[0] != MAGIC4_W_ZPKGLIST_DICT) {
+    // Do we have a dictionary magic?  The zstd dictionary frame
+    // has the same LZ4-compressed dictionary, only the magic is different.
+    if (ret >= 4 && w[0] == MAGIC4_W_ZPKGLIST_DICT)
+	z->dataMagic = MAGIC4_W_ZPKGLIST_DATA;
+    else if (ret >= 4 && w[0] == MAGIC4_W_ZPKGLIST_ZDICT)
+	z->dataMagic = MAGIC4_W_ZPKGLIST_ZDATA;
+    else {
 	// No dictionary magic, no content?
 	// Cannot just return 0, which would indicate physical EOF.
 	// Since there is a valid frame, return an EOF object.
@@ -154,7 +193,7 @@ static int zreader_begin(struct zreader *z, const char *err[2])
     // Verify the first data frame's magic.  Unless the magic is valid,
     // we shouldn't even try to uncompress the dictionary - who knows
     // what we've read?  Pushkin knows?
-    if (z->lead[0] != MAGIC4_W_ZPKGLIST_DATA)
+    if (z->lead[0] != z->dataMagic)
 	return free(buf), ERRSTR("bad data frame magic"), -1;
 
     // Decompress the dictionary.  The dictionary is placed right before
@@ -163,6 +202,15 @@ static int zreader_begin(struct zreader *z, const char *err[2])
     ret = LZ4_decompress_safe(buf + (64 << 10), buf, zsize, 64 << 10);
     if (ret != (64 << 10))
 	return free(buf), ERROR("LZ4_decompress_safe", "cannot decompress dictionary"), -1;
+    if (z->dataMagic == MAGIC4_W_ZPKGLIST_ZDATA) {
+	z->ddict = ZSTD_createDDict(buf, 64 << 10);
+	z->dctx = ZSTD_createDCtx();
+	if (!z->ddict || !z->dctx) {
+	    ZSTD_freeDDict(z->ddict), z->ddict = NULL;
+	    ZSTD_freeDCtx(z->dctx), z->dctx = NULL;
+	    return free(buf), ERRNO("malloc"), -1;
+	}
+    }
     // Are we there yet? (c) Shrek
     z->buf1 = buf + (64 << 10);
     z->jbuf = NULL;
@@ -171,13 +219,16 @@ static int zreader_begin(struct zreader *z, const char *err[2])
     return 1;
 }
 
-int zreader_open(struct zreader **zp, struct fda *fda, const char *err[2])
+int zreader_open(struct zreader **zp, struct fda *fda,
+		 const char *mem, size_t memSize, const char *err[2])
 {
     struct zreader *z = malloc(sizeof *z);
     if (!z)
 	return ERRNO("malloc"), -1;
 
     *z = (struct zreader) { fda };
+    z->mem = mem;
+    z->memSize = memSize;
 
     int rc = zreader_begin(z, err);
     if (rc <= 0)
@@ -186,13 +237,55 @@ int zreader_open(struct zreader **zp, struct fda *fda, const char *err[2])
     return rc;
 }
 
-ssize_t zreader_getFrame(struct zreader *z, void **bufp, off_t *posp,
-			 bool mallocJumbo, const char *err[2])
+// Skip the index frames after the data frames, using buf1 as a scratch
+// buffer, so that the next stream, if any, can be read.
+static bool zreader_skipTrailer(struct zreader *z, char *buf1, const char *err[2])
+{
+    while (1) {
+	ssize_t ret = peeka(z->fda, z->lead, 8);
+	if (ret < 0)
+	    return ERRNO("read"), false;
+	if (ret < 4 || (z->lead[0] != MAGIC4_W_ZPKGLIST_INDEX &&
+			z->lead[0] != MAGIC4_W_ZPKGLIST_NAMES))
+	    break;
+	if (ret != 8)
+	    return ERRSTR("unexpected EOF"), false;
+	z->fda->cur += 8;
+	size_t size = le32toh(z->lead[1]);
+	while (size) {
+	    size_t n = size < z->buf1size ? size : z->buf1size;
+	    ret = reada(z->fda, buf1, n);
+	    if (ret < 0)
+		return ERRNO("read"), false;
+	    if (ret != n)
+		return ERRSTR("unexpected EOF"), false;
+	    size -= n;
+	}
+    }
+    z->trailer = false;
+    return true;
+}
+
+// A data frame which has been read, but not yet decoded.
+struct frame {
+    size_t size, zsize;
+    void *zbuf;
+    off_t pos;
+};
+
+// Read the next data frame into buf1 (which is preceded by the dictionary).
+// Returns 1 on success, 0 on EOF, -1 on error.
+static int zreader_readFrame(struct zreader *z, char *buf1, struct frame *f,
+			     const char *err[2])
 {
     if (z->err)
 	return ERRSTR("pending error"), -1;
-    if (z->eof)
+    if (z->eof) {
+	// Consume the index frames, unless they've been consumed already.
+	if (z->trailer && !zreader_skipTrailer(z, buf1, err))
+	    return -(z->err = true);
 	return 0;
+    }
 
     // The frame has already been peeked upon, decode the sizes.
     size_t zsize = le32toh(z->lead[1]) - 4;
@@ -204,46 +297,57 @@ ssize_t zreader_getFrame(struct zreader *z, void **bufp, off_t *posp,
 	    return ERRSTR("bad data size"), -(z->err = true);
 	if (zsize > z->buf1size)
 	    return ERRSTR("bad data zsize"), -(z->err = true);
-	zbuf = z->buf1;
+	zbuf = buf1;
     }
     else {
 	if (size < 8) // at least (il,dl)
 	    return ERRSTR("bad data size"), -(z->err = true);
 	if (size + zsize > z->buf1size)
 	    return ERRSTR("bad data size+zsize"), -(z->err = true);
-	zbuf = z->buf1 + size;
+	zbuf = buf1 + size;
     }
     // Further check that zsize is consistent with the size.
-    if (!zsize || zsize > LZ4_COMPRESSBOUND(size))
+    if (!zsize || zsize > (z->ddict ? ZSTD_COMPRESSBOUND(size) : LZ4_COMPRESSBOUND(size)))
 	return ERRSTR("bad data zsize"), -(z->err = true);
 
-    // Check the size against contentSize.
+    // Check the size against contentSize.  After a seek, the frames
+    // are no longer accounted for.
     z->contentSizeSoFar += 8 + size;
-    if (z->contentSizeSoFar > z->contentSize)
+    if (z->sequential && z->contentSizeSoFar > z->contentSize)
 	return ERRSTR("bad data size"), -(z->err = true);
 
     // About to read, remember the position.
     off_t pos = tella(z->fda) - 12;
 
-    // Read the frame's compressed data.
-    ssize_t ret = reada(z->fda, zbuf, zsize);
-    if (ret < 0)
-	return ERRNO("read"), -(z->err = true);
-    if (ret != zsize)
-	return ERRSTR("unexpected EOF"), -(z->err = true);
+    // Read the frame's compressed data.  When served from memory, the data
+    // stays put, and can be decoded right from there.
+    ssize_t ret;
+    if (z->mem && z->fda->end == z->mem + z->memSize &&
+	z->fda->end - z->fda->cur >= zsize)
+	zbuf = z->fda->cur, z->fda->cur += zsize;
+    else {
+	ret = reada(z->fda, zbuf, zsize);
+	if (ret < 0)
+	    return ERRNO("read"), -(z->err = true);
+	if (ret != zsize)
+	    return ERRSTR("unexpected EOF"), -(z->err = true);
+    }
 
     // Peek at the next frame.
     ret = peeka(z->fda, z->lead, 12);
     if (ret < 0)
 	return ERRNO("read"), -(z->err = true);
     // Do we have the magic?
-    if (ret < 4 || z->lead[0] != MAGIC4_W_ZPKGLIST_DATA) {
+    if (ret < 4 || z->lead[0] != z->dataMagic) {
 	// No magic, possibly EOF.  If the reads have been sequential,
 	// we have a reliable check for EOF based on contentSize.
 	if (z->sequential && z->contentSizeSoFar != z->contentSize)
 	    return ERRSTR("bad contentSize"), -(z->err = true);
 	// Assume it's EOF.
 	z->eof = true;
+	// The index frames will be consumed with the next call, when the
+	// buffer is no longer in use.
+	z->trailer = true;
     }
     else {
 	// Partial frame header?  No pasaran.
@@ -253,66 +357,680 @@ ssize_t zreader_getFrame(struct zreader *z, void **bufp, off_t *posp,
 	z->fda->cur += 12;
     }
 
-    // Jumbo frame?
-    if (size > (128<<10)) {
-	void *buf;
-	// Malloc requested?
-	if (mallocJumbo)
-	    buf = malloc(size);
-	else {
-	    // Will uncompress into z->jbuf.
-	    if (!z->jbuf) {
-		z->jbuf = malloc(8 + z->jbufsize);
-		if (z->jbuf) {
-		    // Implicit magic bytes.
-		    memcpy(z->jbuf, headerMagic, 8);
-		    z->jbuf += 8;
-		}
+    *f = (struct frame) { size, zsize, zbuf, pos };
+    return 1;
+}
+
+// Decode a normal frame into buf1, using the dictionary placed before buf1
+// (with zstd, using the DDict and the caller's own dctx).
+static bool zreader_decode(struct zreader *z, ZSTD_DCtx *dctx, const struct frame *f,
+			   char *buf1, const char save[8], const char *err[2])
+{
+    if (z->ddict) {
+	size_t zret = ZSTD_decompress_usingDDict(dctx, buf1, f->size,
+						 f->zbuf, f->zsize, z->ddict);
+	if (zret != f->size)
+	    return ERROR("ZSTD_decompress_usingDDict", ZSTD_isError(zret) ?
+			 ZSTD_getErrorName(zret) : "decompression failed"), false;
+	memcpy(buf1 - 8, headerMagic, 8);
+	return true;
+    }
+    // Restore the last bytes of the dictionary.
+    memcpy(buf1 - 8, save, 8);
+    // Uncompress with dictionary.
+    int zret = LZ4_decompress_safe_usingDict(f->zbuf, buf1, f->zsize, f->size,
+					     buf1 - (64 << 10), 64 << 10);
+    if (zret != f->size)
+	return ERROR("LZ4_decompress_safe_usingDict", "decompression failed"), false;
+    // Prepend the magic, clobbers the last bytes of the dictionary.
+    memcpy(buf1 - 8, headerMagic, 8);
+    return true;
+}
+
+// Uncompress a jumbo frame into buf, without dictionary.
+static bool zreader_decompress(struct zreader *z, ZSTD_DCtx *dctx, const struct frame *f,
+			       void *buf, const char *err[2])
+{
+    if (z->ddict) {
+	size_t zret = ZSTD_decompressDCtx(dctx, buf, f->size, f->zbuf, f->zsize);
+	if (zret != f->size)
+	    return ERROR("ZSTD_decompressDCtx", ZSTD_isError(zret) ?
+			 ZSTD_getErrorName(zret) : "decompression failed"), false;
+	return true;
+    }
+    int zret = LZ4_decompress_safe(f->zbuf, buf, f->zsize, f->size);
+    if (zret != f->size)
+	return ERROR("LZ4_decompress_safe", "decompression failed"), false;
+    return true;
+}
+
+// Decode a jumbo frame, see zreader_getFrame.
+static ssize_t zreader_decodeJumbo(struct zreader *z, const struct frame *f,
+				   void **bufp, bool mallocJumbo, const char *err[2])
+{
+    void *buf;
+    // Malloc requested?
+    if (mallocJumbo)
+	buf = malloc(f->size);
+    else {
+	// Will uncompress into z->jbuf.
+	if (!z->jbuf) {
+	    z->jbuf = malloc(8 + z->jbufsize);
+	    if (z->jbuf) {
+		// Implicit magic bytes.
+		memcpy(z->jbuf, headerMagic, 8);
+		z->jbuf += 8;
 	    }
-	    buf = z->jbuf;
 	}
-	if (!buf)
-	    return ERRNO("malloc"), -(z->err = true);
-	// Uncompress without dictionary.
-	int zret = LZ4_decompress_safe(zbuf, buf, zsize, size);
-	if (zret != size) {
-	    if (buf != z->jbuf)
-		free(buf);
-	    return ERROR("LZ4_decompress_safe", "decompression failed"),
-		   -(z->err = true);
+	buf = z->jbuf;
+    }
+    if (!buf)
+	return ERRNO("malloc"), -1;
+    if (!zreader_decompress(z, z->dctx, f, buf, err)) {
+	if (buf != z->jbuf)
+	    free(buf);
+	return -1;
+    }
+    *bufp = buf;
+    // Malloc'd jumbo frame signaled with big negative return.
+    return buf == z->jbuf ? f->size : -f->size;
+}
+
+// The pipelined mode: the background thread reads and decodes frames
+// into the ring of slots, each slot with its own copy of the dictionary.
+// The slots in the range [tail, head) are ready to be consumed.
+// The consumer holds the slot before the tail until the next call.
+struct prefetch {
+    pthread_t thread;
+    // With zstd, the thread's own decompression context.
+    ZSTD_DCtx *dctx;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    size_t head, tail, released;
+    bool held, quit;
+    unsigned nslots;
+    struct slot {
+	char *buf1;
+	char save[8];
+	struct frame f;
+	// The result of zreader_readFrame.
+	int rc;
+	const char *err[2];
+    } slots[];
+};
+
+static void *zreader_prefetchThread(void *arg)
+{
+    struct zreader *z = arg;
+    struct prefetch *pf = z->pf;
+    pthread_mutex_lock(&pf->mutex);
+    while (1) {
+	while (!pf->quit && pf->head - pf->released == pf->nslots)
+	    pthread_cond_wait(&pf->cond, &pf->mutex);
+	if (pf->quit)
+	    break;
+	struct slot *s = &pf->slots[pf->head % pf->nslots];
+	pthread_mutex_unlock(&pf->mutex);
+	// Jumbo frames are decoded by the consumer, see zreader_decodeJumbo.
+	s->rc = zreader_readFrame(z, s->buf1, &s->f, s->err);
+	if (s->rc > 0 && s->f.size <= (128<<10) &&
+	    !zreader_decode(z, pf->dctx, &s->f, s->buf1, s->save, s->err))
+	    s->rc = -1;
+	pthread_mutex_lock(&pf->mutex);
+	pf->head++;
+	pthread_cond_broadcast(&pf->cond);
+	// Done on EOF or error.
+	if (s->rc <= 0)
+	    break;
+    }
+    pthread_mutex_unlock(&pf->mutex);
+    return NULL;
+}
+
+static void zreader_stopPrefetch(struct zreader *z)
+{
+    struct prefetch *pf = z->pf;
+    if (!pf)
+	return;
+    pthread_mutex_lock(&pf->mutex);
+    pf->quit = true;
+    pthread_cond_broadcast(&pf->cond);
+    pthread_mutex_unlock(&pf->mutex);
+    pthread_join(pf->thread, NULL);
+    pthread_mutex_destroy(&pf->mutex);
+    pthread_cond_destroy(&pf->cond);
+    for (unsigned i = 0; i < pf->nslots; i++)
+	free(pf->slots[i].buf1 - (64 << 10));
+    ZSTD_freeDCtx(pf->dctx);
+    free(pf);
+    z->pf = NULL;
+}
+
+bool zreader_prefetch(struct zreader *z, int nframes, const char *err[2])
+{
+    // Already enabled, or no data frames?
+    if (z->pf || !z->buf1)
+	return true;
+    if (nframes < 1)
+	return ERRSTR("bad number of frames"), false;
+    // Plus one slot held by the consumer.
+    unsigned nslots = nframes + 1;
+    struct prefetch *pf = malloc(sizeof *pf + nslots * sizeof pf->slots[0]);
+    if (!pf)
+	return ERRNO("malloc"), false;
+    pf->dctx = NULL;
+    if (z->ddict && !(pf->dctx = ZSTD_createDCtx()))
+	return free(pf), ERRNO("malloc"), false;
+    for (unsigned i = 0; i < nslots; i++) {
+	char *buf = malloc((64<<10) + z->buf1size);
+	if (!buf) {
+	    while (i--)
+		free(pf->slots[i].buf1 - (64 << 10));
+	    return ZSTD_freeDCtx(pf->dctx), free(pf), ERRNO("malloc"), false;
 	}
-	*bufp = buf;
-	// Malloc'd jumbo frame signaled with big negative return.
-	return buf == z->jbuf ? size : -size;
+	memcpy(buf, z->buf1 - (64 << 10), 64 << 10);
+	pf->slots[i].buf1 = buf + (64 << 10);
+	memcpy(pf->slots[i].save, z->save, 8);
     }
+    pf->head = pf->tail = pf->released = 0;
+    pf->held = pf->quit = false;
+    pf->nslots = nslots;
+    pthread_mutex_init(&pf->mutex, NULL);
+    pthread_cond_init(&pf->cond, NULL);
+    z->pf = pf;
+    int rc = pthread_create(&pf->thread, NULL, zreader_prefetchThread, z);
+    if (rc) {
+	pthread_mutex_destroy(&pf->mutex);
+	pthread_cond_destroy(&pf->cond);
+	for (unsigned i = 0; i < nslots; i++)
+	    free(pf->slots[i].buf1 - (64 << 10));
+	ZSTD_freeDCtx(pf->dctx);
+	free(pf), z->pf = NULL;
+	return errno = rc, ERRNO("pthread_create"), false;
+    }
+    return true;
+}
 
-    // Restore the last bytes of the dictionary.
-    memcpy(z->buf1 - 8, z->save, 8);
-    // Uncompress with dictionary.
-    int zret = LZ4_decompress_safe_usingDict(zbuf, z->buf1, zsize, size,
-					     z->buf1 - (64 << 10), 64 << 10);
-    if (zret != size)
-	return ERROR("LZ4_decompress_safe_usingDict", "decompression failed"),
-	       -(z->err = true);
-    // Prepend the magic, clobbers the last bytes of the dictionary.
-    memcpy(z->buf1 - 8, headerMagic, 8);
-    *bufp = z->buf1;
+static ssize_t zreader_getPrefetched(struct zreader *z, void **bufp, off_t *posp,
+				     bool mallocJumbo, const char *err[2])
+{
+    struct prefetch *pf = z->pf;
+    struct slot *s;
+    pthread_mutex_lock(&pf->mutex);
+    // Release the slot from the previous call, unless it was the last one.
+    if (pf->held) {
+	s = &pf->slots[(pf->tail - 1) % pf->nslots];
+	if (s->rc <= 0) {
+	    pthread_mutex_unlock(&pf->mutex);
+	    if (s->rc < 0)
+		return ERRSTR("pending error"), -1;
+	    return 0;
+	}
+	pf->held = false;
+	pf->released++;
+	pthread_cond_broadcast(&pf->cond);
+    }
+    while (pf->head == pf->tail)
+	pthread_cond_wait(&pf->cond, &pf->mutex);
+    s = &pf->slots[pf->tail++ % pf->nslots];
+    pf->held = true;
+    pthread_mutex_unlock(&pf->mutex);
+
+    if (s->rc < 0)
+	return err[0] = s->err[0], err[1] = s->err[1], -1;
+    if (s->rc == 0)
+	return 0;
+    if (posp)
+	*posp = s->f.pos;
+    if (s->f.size > (128<<10)) {
+	ssize_t ret = zreader_decodeJumbo(z, &s->f, bufp, mallocJumbo, err);
+	if (ret == -1)
+	    s->rc = -1;
+	return ret;
+    }
+    *bufp = s->buf1;
+    return s->f.size;
+}
+
+ssize_t zreader_getFrame(struct zreader *z, void **bufp, off_t *posp,
+			 bool mallocJumbo, const char *err[2])
+{
+    if (z->pf)
+	return zreader_getPrefetched(z, bufp, posp, mallocJumbo, err);
+
+    struct frame f;
+    int rc = zreader_readFrame(z, z->buf1, &f, err);
+    if (rc <= 0)
+	return rc;
     if (posp)
-	*posp = pos;
-    return size;
+	*posp = f.pos;
+
+    // Jumbo frame?
+    if (f.size > (128<<10)) {
+	ssize_t ret = zreader_decodeJumbo(z, &f, bufp, mallocJumbo, err);
+	if (ret == -1)
+	    z->err = true;
+	return ret;
+    }
+
+    if (!zreader_decode(z, z->dctx, &f, z->buf1, z->save, err))
+	return -(z->err = true);
+    *bufp = z->buf1;
+    return f.size;
+}
+
+// The parallel mode: the calling thread reads the frames into the slots,
+// each slot with its own copy of the dictionary, and the worker threads
+// decode the frames and pass them on to the callback.
+struct forEach {
+    struct zreader *z;
+    ssize_t (*func)(void *buf, size_t size, off_t pos, void *arg, const char *err[2]);
+    void *arg;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    // The number of headers processed.
+    size_t count;
+    // The reading is done; the workers should stop.
+    bool eof, failed;
+    const char *err[2];
+    // Ready slots are decoded in the reading order.
+    size_t seq;
+    unsigned nslots;
+    struct feSlot {
+	char *buf1;
+	char save[8];
+	struct frame f;
+	enum { SLOT_FREE, SLOT_READY, SLOT_BUSY } state;
+	size_t seq;
+    } slots[];
+};
+
+static void zreader_forEachFail(struct forEach *fe, const char *err[2])
+{
+    if (fe->failed)
+	return;
+    fe->failed = true;
+    fe->err[0] = err[0], fe->err[1] = err[1];
+}
+
+static void *zreader_forEachThread(void *arg)
+{
+    struct forEach *fe = arg;
+    // Jumbo frames are decoded into the worker's own buffer.
+    char *jbuf = NULL;
+    // With zstd, each worker needs its own decompression context.
+    ZSTD_DCtx *dctx = NULL;
+    pthread_mutex_lock(&fe->mutex);
+    while (1) {
+	struct feSlot *s = NULL;
+	while (!fe->failed) {
+	    for (unsigned i = 0; i < fe->nslots; i++) {
+		struct feSlot *t = &fe->slots[i];
+		if (t->state == SLOT_READY && (!s || t->seq < s->seq))
+		    s = t;
+	    }
+	    if (s || fe->eof)
+		break;
+	    pthread_cond_wait(&fe->cond, &fe->mutex);
+	}
+	if (!s || fe->failed)
+	    break;
+	s->state = SLOT_BUSY;
+	pthread_mutex_unlock(&fe->mutex);
+
+	ssize_t n = -1;
+	const char *err[2];
+	if (fe->z->ddict && !dctx)
+	    dctx = ZSTD_createDCtx();
+	if (fe->z->ddict && !dctx)
+	    ERRNO("malloc");
+	else if (s->f.size > (128<<10)) {
+	    if (!jbuf)
+		jbuf = malloc(fe->z->jbufsize);
+	    if (!jbuf)
+		ERRNO("malloc");
+	    else if (zreader_decompress(fe->z, dctx, &s->f, jbuf, err))
+		n = fe->func(jbuf, s->f.size, s->f.pos, fe->arg, err);
+	}
+	else if (zreader_decode(fe->z, dctx, &s->f, s->buf1, s->save, err))
+	    n = fe->func(s->buf1, s->f.size, s->f.pos, fe->arg, err);
+
+	pthread_mutex_lock(&fe->mutex);
+	s->state = SLOT_FREE;
+	if (n < 0)
+	    zreader_forEachFail(fe, err);
+	else
+	    fe->count += n;
+	pthread_cond_broadcast(&fe->cond);
+    }
+    pthread_mutex_unlock(&fe->mutex);
+    free(jbuf);
+    ZSTD_freeDCtx(dctx);
+    return NULL;
+}
+
+ssize_t zreader_forEachFrame(struct zreader *z, int nthreads,
+	ssize_t (*func)(void *buf, size_t size, off_t pos, void *arg, const char *err[2]),
+	void *arg, const char *err[2])
+{
+    // The prefetch thread owns the input.
+    if (z->pf)
+	return ERRSTR("cannot be used in the pipelined mode"), -1;
+    if (z->err)
+	return ERRSTR("pending error"), -1;
+    // No data frames, or at EOF already.
+    if (!z->buf1 || z->eof)
+	return 0;
+
+    // Two slots per thread, so that the threads needn't wait for the reading.
+    unsigned nslots = 2 * nthreads;
+    struct forEach *fe = malloc(sizeof *fe + nslots * sizeof fe->slots[0]);
+    if (!fe)
+	return ERRNO("malloc"), -1;
+    *fe = (struct forEach) { z, func, arg };
+    fe->nslots = nslots;
+    for (unsigned i = 0; i < nslots; i++) {
+	char *buf = malloc((64<<10) + z->buf1size);
+	if (!buf) {
+	    while (i--)
+		free(fe->slots[i].buf1 - (64 << 10));
+	    return free(fe), ERRNO("malloc"), -1;
+	}
+	memcpy(buf, z->buf1 - (64 << 10), 64 << 10);
+	fe->slots[i] = (struct feSlot) { buf + (64 << 10) };
+	memcpy(fe->slots[i].save, z->save, 8);
+    }
+    pthread_mutex_init(&fe->mutex, NULL);
+    pthread_cond_init(&fe->cond, NULL);
+
+    pthread_t *tid = malloc(nthreads * sizeof *tid);
+    if (!tid) {
+	ERRNO("malloc");
+	zreader_forEachFail(fe, err);
+    }
+    int nt;
+    for (nt = 0; tid && nt < nthreads; nt++) {
+	int rc = pthread_create(&tid[nt], NULL, zreader_forEachThread, fe);
+	if (rc) {
+	    errno = rc, ERRNO("pthread_create");
+	    pthread_mutex_lock(&fe->mutex);
+	    zreader_forEachFail(fe, err);
+	    pthread_mutex_unlock(&fe->mutex);
+	    break;
+	}
+    }
+
+    // Read the frames, unless failed to create any threads.
+    pthread_mutex_lock(&fe->mutex);
+    while (nt && !fe->failed) {
+	struct feSlot *s = NULL;
+	for (unsigned i = 0; i < nslots && !s; i++)
+	    if (fe->slots[i].state == SLOT_FREE)
+		s = &fe->slots[i];
+	if (!s) {
+	    pthread_cond_wait(&fe->cond, &fe->mutex);
+	    continue;
+	}
+	pthread_mutex_unlock(&fe->mutex);
+	int rc = zreader_readFrame(z, s->buf1, &s->f, err);
+	pthread_mutex_lock(&fe->mutex);
+	if (rc <= 0) {
+	    if (rc < 0)
+		zreader_forEachFail(fe, err);
+	    break;
+	}
+	s->state = SLOT_READY;
+	s->seq = fe->seq++;
+	pthread_cond_broadcast(&fe->cond);
+    }
+    fe->eof = true;
+    pthread_cond_broadcast(&fe->cond);
+    pthread_mutex_unlock(&fe->mutex);
+
+    while (nt--)
+	pthread_join(tid[nt], NULL);
+    free(tid);
+    pthread_mutex_destroy(&fe->mutex);
+    pthread_cond_destroy(&fe->cond);
+    for (unsigned i = 0; i < nslots; i++)
+	free(fe->slots[i].buf1 - (64 << 10));
+    ssize_t ret = fe->count;
+    if (fe->failed) {
+	err[0] = fe->err[0], err[1] = fe->err[1];
+	z->err = true;
+	ret = -1;
+    }
+    free(fe);
+    return ret;
 }
 
 void zreader_free(struct zreader *z)
 {
     if (!z)
 	return;
+    zreader_stopPrefetch(z);
     if (z->buf1)
 	free(z->buf1 - (64 << 10));
     if (z->jbuf)
 	free(z->jbuf - 8);
+    free(z->index);
+    free(z->names);
+    ZSTD_freeDDict(z->ddict);
+    ZSTD_freeDCtx(z->dctx);
     free(z);
 }
 
+bool zreader_seek(struct zreader *z, off_t pos, const char *err[2])
+{
+    // No data frames, no dictionary.
+    if (!z->buf1)
+	return ERRSTR("bad position"), false;
+    // The prefetch thread has to be restarted at the new position.
+    unsigned nslots = z->pf ? z->pf->nslots : 0;
+    zreader_stopPrefetch(z);
+    z->sequential = false;
+    z->eof = z->trailer = false;
+    z->err = true;
+    if (!seeka(z->fda, pos, z->mem, z->memSize))
+	return ERRNO("lseek"), false;
+    // Read the frame header, as zreader_getFrame expects it.
+    ssize_t ret = reada(z->fda, z->lead, 12);
+    if (ret < 0)
+	return ERRNO("read"), false;
+    if (ret != 12)
+	return ERRSTR("unexpected EOF"), false;
+    if (z->lead[0] != z->dataMagic)
+	return ERRSTR("bad data frame magic"), false;
+    z->err = false;
+    if (nslots)
+	return zreader_prefetch(z, nslots - 1, err);
+    return true;
+}
+
+// Read at the position, relative to where the reading started,
+// without disturbing the readahead.
+static ssize_t zreader_pread(struct zreader *z, void *buf, size_t size, off_t pos)
+{
+    if (z->mem) {
+	if (pos >= z->memSize)
+	    return 0;
+	if (size > z->memSize - pos)
+	    size = z->memSize - pos;
+	memcpy(buf, z->mem + pos, size);
+	return size;
+    }
+    return pread(z->fda->fd, buf, size, z->base + pos);
+}
+
+// The name index frame, if any, comes right before the index frame.
+static ssize_t zreader_loadNames(struct zreader *z, off_t ipos, off_t minpos,
+				 const char *err[2])
+{
+    unsigned size;
+    if (ipos - 4 < minpos)
+	return 0;
+    ssize_t ret = zreader_pread(z, &size, 4, ipos - 4);
+    if (ret < 0)
+	return ERRNO("pread"), -1;
+    if (ret != 4)
+	return ERRSTR("unexpected EOF"), -1;
+    size = le32toh(size);
+    if (size < 4 + 8 || (size - 4) % 8)
+	return 0;
+    off_t npos = ipos - 8 - (off_t) size;
+    if (npos < minpos)
+	return 0;
+    unsigned *buf = malloc(8 + size);
+    if (!buf)
+	return ERRNO("malloc"), -1;
+    ret = zreader_pread(z, buf, 8 + size, npos);
+    if (ret < 0)
+	return free(buf), ERRNO("pread"), -1;
+    if (ret != 8 + size)
+	return free(buf), ERRSTR("unexpected EOF"), -1;
+    if (buf[0] != MAGIC4_W_ZPKGLIST_NAMES || le32toh(buf[1]) != size)
+	return free(buf), 0;
+
+    // Convert in place, the entries are sorted by hash.
+    size_t n = (size - 4) / 8;
+    struct zreaderName *names = (void *) (buf + 2);
+    for (size_t i = 0; i < n; i++) {
+	names[i].hash = le32toh(names[i].hash);
+	names[i].hdr = le32toh(names[i].hdr);
+	unsigned frame = names[i].hdr >> 2, ix = names[i].hdr & 3;
+	if (frame >= z->nindex || ix >= z->index[frame].count)
+	    return free(buf), ERRSTR("bad name index"), -1;
+	if (i && names[i].hash < names[i-1].hash)
+	    return free(buf), ERRSTR("bad name index order"), -1;
+    }
+    // Move the entries to the beginning of the buffer.
+    memmove(buf, names, n * sizeof *names);
+    z->names = (void *) buf;
+    z->nnames = n;
+    return n;
+}
+
+static ssize_t zreader_loadIndex(struct zreader *z, const char *err[2])
+{
+    // No data frames, no index.
+    if (!z->buf1)
+	return 0;
+    // The index is read from the end of the file (or the memory buffer).
+    // Positions are relative to where the reading started.
+    off_t end;
+    if (z->mem)
+	end = z->memSize;
+    else {
+	// Reading with a callback, see zpkglistReadopen.
+	if (z->fda->fd < 0)
+	    return 0;
+	struct stat st;
+	if (fstat(z->fda->fd, &st) < 0)
+	    return ERRNO("fstat"), -1;
+	if (!S_ISREG(st.st_mode))
+	    return 0;
+	if (z->base < 0)
+	    return ERRSTR("lseek failed"), -1;
+	end = st.st_size - z->base;
+    }
+
+    // The index frame ends with its size.
+    unsigned size;
+    if (end < z->pos0 + 4)
+	return 0;
+    ssize_t ret = zreader_pread(z, &size, 4, end - 4);
+    if (ret < 0)
+	return ERRNO("pread"), -1;
+    if (ret != 4)
+	return ERRSTR("unexpected EOF"), -1;
+    size = le32toh(size);
+    if (size < 12 + 16 || (size - 12) % 16)
+	return 0;
+    // The index frame must come after the leading frame.
+    off_t ipos = end - 8 - (off_t) size;
+    if (ipos < z->pos0 + 24)
+	return 0;
+
+    // Read the whole frame.
+    unsigned *buf = malloc(8 + size);
+    if (!buf)
+	return ERRNO("malloc"), -1;
+    ret = zreader_pread(z, buf, 8 + size, ipos);
+    if (ret < 0)
+	return free(buf), ERRNO("pread"), -1;
+    if (ret != 8 + size)
+	return free(buf), ERRSTR("unexpected EOF"), -1;
+    if (buf[0] != MAGIC4_W_ZPKGLIST_INDEX || le32toh(buf[1]) != size)
+	return free(buf), 0;
+    // The frame records its own offset relative to the leading frame.
+    // If it doesn't match, the index belongs to another stream.
+    uint64_t ioff;
+    memcpy(&ioff, (char *) buf + 8 + size - 12, 8);
+    ioff = le64toh(ioff);
+    if (ioff != ipos - z->pos0)
+	return free(buf), 0;
+
+    // Now that the index is known to belong to this stream,
+    // any inconsistency is an error.
+    size_t n = (size - 12) / 16;
+    struct zpkglistFrame *index = malloc(n * sizeof *index);
+    if (!index)
+	return free(buf), ERRNO("malloc"), -1;
+    uint64_t total = 0, prev = 0;
+    for (size_t i = 0; i < n; i++) {
+	struct {
+	    uint64_t off;
+	    unsigned size;
+	    unsigned count;
+	} e;
+	memcpy(&e, buf + 2 + 4 * i, 16);
+	uint64_t off = le64toh(e.off);
+	size_t fsize = le32toh(e.size);
+	unsigned count = le32toh(e.count);
+	// The frames must be in order, and precede the index frame.
+	if (off <= prev || off + 12 >= ioff)
+	    return free(buf), free(index), ERRSTR("bad index offset"), -1;
+	if (fsize < 8 || (fsize > (128<<10) && fsize > z->jbufsize))
+	    return free(buf), free(index), ERRSTR("bad index size"), -1;
+	if (count < 1 || count > 4 || (fsize > (128<<10) && count > 1))
+	    return free(buf), free(index), ERRSTR("bad index count"), -1;
+	total += 8 + fsize, prev = off;
+	index[i] = (struct zpkglistFrame) { (int64_t)(z->pos0 + off) << 2, fsize, count };
+    }
+    free(buf);
+    if (total != z->contentSize)
+	return free(index), ERRSTR("bad index contentSize"), -1;
+    z->index = index;
+    z->nindex = n;
+    if (zreader_loadNames(z, ipos, z->pos0 + 24, err) < 0) {
+	free(z->index), z->index = NULL, z->nindex = 0;
+	return -1;
+    }
+    return n;
+}
+
+ssize_t zreader_frameIndex(struct zreader *z, const struct zpkglistFrame **framesp,
+			   const char *err[2])
+{
+    if (!z->indexLoaded) {
+	if (zreader_loadIndex(z, err) < 0)
+	    return -1;
+	z->indexLoaded = true;
+    }
+    *framesp = z->index;
+    return z->nindex;
+}
+
+ssize_t zreader_nameIndex(struct zreader *z, const struct zreaderName **namesp,
+			  const char *err[2])
+{
+    const struct zpkglistFrame *frames;
+    if (zreader_frameIndex(z, &frames, err) < 0)
+	return -1;
+    *namesp = z->names;
+    return z->nnames;
+}
+
 unsigned zreader_contentSize(struct zreader *z)
 {
     return z->contentSize;
@@ -27,8 +27,12 @@ struct fda; // reada.h
 struct zreader;
 
 // A lower-level API for reading zpkglist files, similar to lz4reader.
-int zreader_open(struct zreader **zp, struct fda *fda, const char *err[2])
-		 __attribute__((nonnull));
+// If the readahead is served from memory (mem corresponds to the position
+// 0, see struct zpkglistReader), the frames are decoded right from there,
+// and so is the index read.
+int zreader_open(struct zreader **zp, struct fda *fda,
+		 const char *mem, size_t memSize, const char *err[2])
+		 __attribute__((nonnull(1,2,5)));
 
 void zreader_free(struct zreader *z);
 
@@ -46,4 +50,39 @@ ssize_t zreader_getFrame(struct zreader *z, void **bufp, off_t *posp,
 
 unsigned zreader_contentSize(struct zreader *z) __attribute__((nonnull));
 
+// Load the index frame from the end of the file.  Returns the number
+// of data frames, 0 if there is no index, -1 on error.
+struct zpkglistFrame;
+ssize_t zreader_frameIndex(struct zreader *z, const struct zpkglistFrame **framesp,
+			   const char *err[2]) __attribute__((nonnull));
+
+// The name index, loaded along with the index of data frames.
+// The header number is the frame number in the index << 2 + header no.
+struct zreaderName {
+    unsigned hash;
+    unsigned hdr;
+};
+ssize_t zreader_nameIndex(struct zreader *z, const struct zreaderName **namesp,
+			  const char *err[2]) __attribute__((nonnull));
+
+// Reposition the reader at the data frame which starts at the file
+// offset pos, as previously returned by zreader_getFrame.
+bool zreader_seek(struct zreader *z, off_t pos, const char *err[2])
+		  __attribute__((nonnull));
+
+// Enable the pipelined mode: a background thread reads and decodes up to
+// nframes frames ahead.  Jumbo frames are only read ahead, and are decoded
+// in zreader_getFrame, so that they can be malloc'd as before.
+bool zreader_prefetch(struct zreader *z, int nframes, const char *err[2])
+		      __attribute__((nonnull));
+
+// Decode the rest of the frames in parallel, using nthreads worker threads.
+// The function is called from the worker threads, with each decoded frame
+// (without the leading magic) and its file offset, in no particular order;
+// it returns the number of headers processed, -1 on error.  Returns the
+// total number of headers, -1 on error.
+ssize_t zreader_forEachFrame(struct zreader *z, int nthreads,
+	ssize_t (*func)(void *buf, size_t size, off_t pos, void *arg, const char *err[2]),
+	void *arg, const char *err[2]) __attribute__((nonnull(1,3,5)));
+
 #pragma GCC visibility pop